@@ -1,345 +1,5481 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <time.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <linux/futex.h>
+#include <immintrin.h>
 
-#define MAX_CAPACITY  16000000
 #define MAX_LINE_LEN  128
 #define MAX_FIELDS    8
 #define DELIM         ','
+#define MAX_TASKS     128
+#define OUTBUF_SIZE   (1 << 20)
+#define MAX_THREADS   64
+#define MAX_NODES     64
+#define ARENA_CHUNK_SHIFT 20
+#define ARENA_CHUNK_SIZE  ((size_t) 1 << ARENA_CHUNK_SHIFT)
+#define ARENA_CACHE_CHUNKS 64
+#define HEAP_REF_BITS     40
+#define HEAP_MAX_CHUNKS   ((size_t) 1 << (HEAP_REF_BITS - ARENA_CHUNK_SHIFT))
+#define SEGMENT_SHIFT 16
+#define SEGMENT_ROWS  ((size_t) 1 << SEGMENT_SHIFT)
+#define SEGMENT_MASK  (SEGMENT_ROWS - 1)
+#define PARSE_CHUNK_MIN (4 << 20)
+#define PARALLEL_MIN_ROWS (1 << 16)
 
 
+// Records refer to their line with a 40-bit reference into the table's string heap, split
+// so it fits the padding, and to their fields with 16-bit offsets into the line: 24 bytes
+// instead of 80 with pointers. A field must therefore start in the first 64 KiB of its line.
 typedef struct {
-    char *line;
-    char *fields[MAX_FIELDS];
-    int nfields;
+    uint32_t line;    // low 32 bits of the heap reference
+    uint16_t fields[MAX_FIELDS];
+    uint8_t nfields;
+    uint8_t coded;    // bit f: field f holds FSST codes instead of text
+    uint8_t line_hi;  // high 8 bits of the heap reference
 } record_t;
 
+// String heap of a table: a directory of chunks that lines are bump-allocated from. A
+// reference is (chunk index << ARENA_CHUNK_SHIFT) | offset, so a heap holds up to 1 TiB.
+// The heap is mapped lazily, so only the directory pages in use are ever touched.
+// Threads filling the same table take chunk slots with an atomic increment.
+typedef struct arena_chunk {
+    struct arena_chunk *next; // only while the chunk sits in a thread cache
+} arena_chunk_t;
 
-static inline void read_csv_file(const char *filename,
-                          record_t **records_out, size_t *count_out) {
+typedef struct {
+    char *chunks[HEAP_MAX_CHUNKS];
+    atomic_size_t nchunks;
+} heap_t;
+
+// Tables are a directory of fixed-size segments. Every segment except the last one is
+// full, so row i is segments[i >> SEGMENT_SHIFT]->rows[i & SEGMENT_MASK]. Appending adds
+// segments and never moves rows.
+typedef struct {
+    record_t rows[SEGMENT_ROWS];
+} segment_t;
+
+// Column codecs. FSST string compression (Boncz, Neumann, Leis, VLDB 2020): up to 255
+// symbols of 1 to 8 bytes that are replaced by one-byte codes, code 255 escapes a literal
+// byte. A coded field is stored as its code length (one byte, two from 128 on) followed by
+// the codes. Numbers are stored frame of reference: value - base in width little-endian
+// bytes. Values a number codec cannot reproduce exactly stay text.
+#define FSST_ESCAPE 255
+#define MAX_CODECS 64
+
+typedef enum { CODEC_FSST, CODEC_INT, CODEC_DECIMAL, CODEC_DATE } codec_type_t;
+
+typedef struct codec {
+    codec_type_t type;
+    int64_t base;                  // numbers
+    int width;
+    int scale;                     // digits after the point of decimals
+    uint64_t symbols[FSST_ESCAPE]; // little-endian, zero padded
+    uint8_t lens[FSST_ESCAPE];
+    int nsymbols;
+    uint8_t order[FSST_ESCAPE];    // codes grouped by first byte, longest symbol first
+    uint16_t first[257];           // the codes starting with byte c are order[first[c]..first[c + 1])
+    const char *source;            // file and column, for --stats
+    int column;
+    atomic_size_t raw_bytes;
+    atomic_size_t coded_bytes;
+} codec_t;
+
+typedef struct {
+    size_t raw;
+    size_t coded;
+} codec_counts_t;
+
+// Front-coded copy of the key column of a sorted table: every key is stored as the length
+// of the prefix it shares with the previous key, the length of the rest and the rest.
+// Every KEY_BLOCK-th key is stored whole so lookups can binary search these restarts.
+#define KEY_BLOCK 16
+
+typedef struct {
+    uint8_t *data;
+    size_t *restarts; // offset of the entry of row b * KEY_BLOCK
+    size_t size;
+    int col;          // 0 if the table has no key column
+} key_column_t;
+
+// Hashes of the keys of column col, one per row in row order (see hash_column_build).
+typedef struct {
+    uint32_t *values;
+    size_t count;
+    int col;          // 0 if the table has no hash column
+} hash_column_t;
+
+// Hash index over the keys of column col for hash joins: open addressing with linear
+// probing. A slot holds the key's hash in the high and row + 1 in the low 32 bits, 0 if
+// empty, so probes compare hashes as fingerprints before reading a row.
+typedef struct {
+    _Atomic uint64_t *slots;
+    size_t mask;      // slots - 1, a power of two minus one
+    int col;          // 0 if the table has no hash index
+} hash_index_t;
+
+// Minimal perfect hash of a set of distinct keys (BBHash): on every level each remaining
+// key hashes to one bit of a bit vector; bits hit by one key only are kept, the keys
+// hitting the other bits go on to the next level. A key's number is the rank of its bit.
+// Keys colliding on every level are kept with their text in a fallback list.
+#define MPH_LEVELS 24
+
+typedef struct {
+    uint64_t *bits;      // all levels, level l in words [levels[l], levels[l + 1])
+    uint32_t *ranks;     // set bits before every word
+    size_t levels[MPH_LEVELS + 1];
+    int nlevels;
+    size_t nkeys;
+    size_t nbits_set;    // keys placed on a level; fallback key j has number nbits_set + j
+    size_t nfallback;
+    uint64_t *fallback_hashes;
+    char **fallback_keys;
+} mph_t;
+
+// Learned index of a table sorted on col: the keys' 8-byte prefixes, read as integers like
+// in the prefix sort, mapped to the first row having them by a piecewise linear model whose
+// segments predict every such row within MODEL_ERROR rows. A longer run of rows sharing a
+// prefix gets a segment of its own with a nested model over the next 8 key bytes, up to
+// MODEL_DEPTH levels.
+#define MODEL_ERROR 32
+#define MODEL_DEPTH 4
+#define MODEL_RADIX_BITS 16
+
+typedef struct learned_index learned_index_t;
+
+typedef struct {
+    uint64_t key;            // prefix of the segment's first key
+    size_t row;              // first row with that prefix
+    double slope;            // rows per prefix unit
+    learned_index_t *inner;  // model of the run of rows with prefix key, NULL if none
+} model_segment_t;
+
+struct learned_index {
+    model_segment_t *segments;
+    size_t nsegments;
+    uint64_t *prefixes; // prefix of every row's key, so searches mostly compare integers (top level only)
+    uint32_t *radix;    // first segment per top MODEL_RADIX_BITS of the prefix (top level only)
+    size_t count;
+    int col;          // 0 if the table has no learned index
+};
+
+// Rows of a table chained by the number their key gets from the minimal perfect hash. Entry
+// k holds the upper half of the key's hash and its first row + 1, like a hash index slot,
+// so keys outside the set are mostly turned away without reading a row; the next rows with
+// the key follow next[row] - 1 up to a 0.
+typedef struct {
+    mph_t mph;
+    uint64_t *entries;
+    uint32_t *next;
+    size_t count;
+    int col;          // 0 if the table has no perfect hash index
+} mph_index_t;
+
+typedef struct {
+    segment_t **segments;
+    size_t nsegments;
+    size_t capacity; // directory slots
+    size_t released; // leading segments already freed by a streaming consumer
+    size_t count;
+    heap_t *heap;    // may be shared with the other parts of a table filled in parallel
+    size_t heap_pos; // bump allocation cursor of this appender in the heap
+    size_t heap_end;
+    struct codec *codecs[MAX_FIELDS]; // per field, NULL if the field is stored as text
+    key_column_t keys;
+    hash_column_t hashes;
+    hash_index_t index;
+    mph_index_t mph;
+    learned_index_t model;
+    int sorted_col; // column the rows are known to be sorted on, 0 = none
+    unsigned text_cols; // columns (bit col) a later join reads as its key, never left encoded
+} table_t;
+
+// NUMA placement. Workers are spread round-robin over the nodes; tables are either
+// first-touched by the worker that fills them or interleaved over all nodes.
+typedef enum { NUMA_OFF, NUMA_LOCAL, NUMA_INTERLEAVE } numa_mode_t;
+
+typedef struct {
+    int nnodes;
+    int node_ids[MAX_NODES];
+    cpu_set_t cpus[MAX_NODES];
+} numa_topology_t;
+
+static numa_mode_t g_numa_mode = NUMA_LOCAL;
+static numa_topology_t g_numa;
+
+// Parses a kernel style cpu/node list such as "0-3,8,10-11" into a cpu set.
+static inline int parse_cpu_list(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    const char *p = list;
+    while (*p && *p != '\n') {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0) return -1;
+        long last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first) return -1;
+        }
+        for (long c = first; c <= last && c < CPU_SETSIZE; c++) CPU_SET(c, set);
+        p = end;
+        if (*p == ',') p++;
+        else if (*p && *p != '\n') return -1;
+    }
+    return 0;
+}
+
+static inline int read_sysfs_line(const char *path, char *buf, const size_t size) {
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    const int ok = fgets(buf, (int) size, f) != NULL;
+    fclose(f);
+    return ok ? 0 : -1;
+}
+
+// Falls back to a single node holding every cpu when sysfs has no NUMA information.
+static inline void numa_detect(void) {
+    char buf[4096];
+    cpu_set_t nodes, allowed;
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    g_numa.nnodes = 0;
+
+    if (read_sysfs_line("/sys/devices/system/node/online", buf, sizeof(buf)) == 0 &&
+        parse_cpu_list(buf, &nodes) == 0) {
+        for (int n = 0; n < CPU_SETSIZE && g_numa.nnodes < MAX_NODES; n++) {
+            if (!CPU_ISSET(n, &nodes)) continue;
+            char path[64];
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", n);
+            cpu_set_t cpus;
+            if (read_sysfs_line(path, buf, sizeof(buf)) != 0 || parse_cpu_list(buf, &cpus) != 0) continue;
+            CPU_AND(&cpus, &cpus, &allowed);
+            if (CPU_COUNT(&cpus) == 0) continue; // memory-only node or excluded by --cpus
+            g_numa.node_ids[g_numa.nnodes] = n;
+            g_numa.cpus[g_numa.nnodes] = cpus;
+            g_numa.nnodes++;
+        }
+    }
+
+    if (g_numa.nnodes == 0) {
+        g_numa.nnodes = 1;
+        g_numa.node_ids[0] = 0;
+        g_numa.cpus[0] = allowed;
+    }
+}
+
+static inline void numa_bind_thread_to_node(const int node_index) {
+    if (sched_setaffinity(0, sizeof(cpu_set_t), &g_numa.cpus[node_index]) != 0) {
+        perror("sched_setaffinity");
+    }
+}
+
+// Core pinning (--pin). The last cpu of the allowed set is reserved for the writer,
+// workers are pinned round-robin to the remaining ones.
+typedef enum { ROLE_WORKER, ROLE_WRITER } thread_role_t;
+
+static int g_pin;
+static int g_pin_cpus[CPU_SETSIZE];
+static int g_npin_cpus;
+
+static inline void pin_init(void) {
+    cpu_set_t allowed;
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    g_npin_cpus = 0;
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+        if (CPU_ISSET(c, &allowed)) g_pin_cpus[g_npin_cpus++] = c;
+    }
+}
+
+static inline void pin_thread_to_cpu(const int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        perror("sched_setaffinity");
+    }
+}
+
+// Node id the thread's memory is first touched on under --numa=local, -1 when it may be any node.
+static _Thread_local int tl_node = -1;
+
+static inline void thread_bind(const thread_role_t role, const int index) {
+    if (g_pin && g_npin_cpus > 0) {
+        const int worker_cpus = g_npin_cpus > 1 ? g_npin_cpus - 1 : 1;
+        const int cpu = role == ROLE_WRITER ? g_pin_cpus[g_npin_cpus - 1] : g_pin_cpus[index % worker_cpus];
+        pin_thread_to_cpu(cpu);
+        if (g_numa_mode == NUMA_LOCAL && g_numa.nnodes > 1) {
+            for (int n = 0; n < g_numa.nnodes; n++) {
+                if (CPU_ISSET(cpu, &g_numa.cpus[n])) tl_node = g_numa.node_ids[n];
+            }
+        }
+    } else if (g_numa_mode != NUMA_OFF && g_numa.nnodes > 1) {
+        const int node_index = role == ROLE_WRITER ? 0 : index % g_numa.nnodes;
+        numa_bind_thread_to_node(node_index);
+        if (g_numa_mode == NUMA_LOCAL) tl_node = g_numa.node_ids[node_index];
+    }
+}
+
+static inline long numa_mbind(void *addr, const size_t len, const int mode, const unsigned long *mask) {
+    return syscall(SYS_mbind, addr, len, mode, mask, mask ? MAX_NODES + 1 : 0, 0);
+}
+
+// Large table allocations bypass malloc so that a NUMA policy can be applied to them.
+// The pages are only backed once they are touched.
+static inline void *table_alloc(const size_t bytes) {
+    void *mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) return NULL;
+
+    if (g_numa_mode == NUMA_INTERLEAVE && g_numa.nnodes > 1) {
+        unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long)) + 1] = {0};
+        for (int n = 0; n < g_numa.nnodes; n++) {
+            const int id = g_numa.node_ids[n];
+            mask[id / (8 * sizeof(unsigned long))] |= 1UL << (id % (8 * sizeof(unsigned long)));
+        }
+        if (numa_mbind(mem, bytes, MPOL_INTERLEAVE, mask) != 0) perror("mbind");
+    }
+    return mem;
+}
+
+static inline void table_free(void *mem, const size_t bytes) {
+    if (mem) munmap(mem, bytes);
+}
+
+// Per-thread allocation. Every table owns an arena whose chunks come from the cache of
+// the thread filling it; freeing a table hands its chunks to the freeing thread's cache
+// (only the chunks on the thread's own node under --numa=local).
+// Nothing on this path is shared between threads, so parallel stages never contend.
+typedef struct {
+    size_t allocs;       // strings allocated from arenas
+    size_t bytes;        // bytes handed out by arenas
+    size_t chunk_hits;   // chunks reused from the thread cache
+    size_t chunk_misses; // chunks freshly mapped
+    size_t chunks_freed; // chunks returned to the thread cache or unmapped
+    size_t outbufs;      // output buffers taken from the writer's pool
+} alloc_stats_t;
+
+static alloc_stats_t g_alloc_stats[MAX_THREADS];
+static _Thread_local alloc_stats_t *tl_stats = &g_alloc_stats[0];
+static _Thread_local arena_chunk_t *tl_chunk_cache;
+static _Thread_local int tl_cached_chunks;
+static int g_print_stats;
+
+static inline arena_chunk_t *arena_chunk_get(void) {
+    arena_chunk_t *chunk = tl_chunk_cache;
+    if (chunk) {
+        tl_chunk_cache = chunk->next;
+        tl_cached_chunks--;
+        tl_stats->chunk_hits++;
+        return chunk;
+    }
+    chunk = table_alloc(ARENA_CHUNK_SIZE);
+    if (!chunk) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+    tl_stats->chunk_misses++;
+    return chunk;
+}
+
+// Node the chunk's first page was placed on, -1 if the kernel cannot tell.
+static inline int chunk_node(arena_chunk_t *chunk) {
+    int node;
+    if (syscall(SYS_get_mempolicy, &node, NULL, 0, chunk, MPOL_F_NODE | MPOL_F_ADDR) != 0) return -1;
+    return node;
+}
+
+// Under --numa=local a chunk keeps the node of the thread that first touched it, so a
+// thread only caches chunks placed on its own node and unmaps the others.
+static inline void arena_chunk_put(arena_chunk_t *chunk) {
+    tl_stats->chunks_freed++;
+    if (tl_cached_chunks < ARENA_CACHE_CHUNKS && (tl_node < 0 || chunk_node(chunk) == tl_node)) {
+        chunk->next = tl_chunk_cache;
+        tl_chunk_cache = chunk;
+        tl_cached_chunks++;
+    } else {
+        table_free(chunk, ARENA_CHUNK_SIZE);
+    }
+}
+
+// Unmaps the calling thread's cached chunks, called when a thread is done.
+static inline void arena_cache_release(void) {
+    while (tl_chunk_cache) {
+        arena_chunk_t *next = tl_chunk_cache->next;
+        table_free(tl_chunk_cache, ARENA_CHUNK_SIZE);
+        tl_chunk_cache = next;
+    }
+    tl_cached_chunks = 0;
+}
+
+static inline heap_t *heap_create(void) {
+    heap_t *heap = table_alloc(sizeof(heap_t));
+    if (!heap) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+    return heap;
+}
+
+static inline char *heap_ptr(const heap_t *heap, const uint64_t ref) {
+    return heap->chunks[ref >> ARENA_CHUNK_SHIFT] + (ref & (ARENA_CHUNK_SIZE - 1));
+}
+
+// Allocates size bytes from the table's heap for the line of record.
+static inline char *heap_alloc(table_t *table, const size_t size, record_t *record) {
+    if (!table->heap) table->heap = heap_create();
+
+    if (table->heap_end - table->heap_pos < size) {
+        if (size > ARENA_CHUNK_SIZE) {
+            fprintf(stderr, "Allocation of %zu bytes exceeds heap chunk size!\n", size);
+            exit(EXIT_FAILURE);
+        }
+        const size_t slot = atomic_fetch_add(&table->heap->nchunks, 1);
+        if (slot >= HEAP_MAX_CHUNKS) {
+            fprintf(stderr, "Table heap exceeds 1 TiB!\n");
+            exit(EXIT_FAILURE);
+        }
+        table->heap->chunks[slot] = (char *) arena_chunk_get();
+        table->heap_pos = slot << ARENA_CHUNK_SHIFT;
+        table->heap_end = table->heap_pos + ARENA_CHUNK_SIZE;
+    }
+    const uint64_t ref = table->heap_pos;
+    record->line = (uint32_t) ref;
+    record->line_hi = (uint8_t) (ref >> 32);
+    table->heap_pos += size;
+    tl_stats->allocs++;
+    tl_stats->bytes += size;
+    return heap_ptr(table->heap, ref);
+}
+
+static inline void heap_free(heap_t *heap) {
+    if (!heap) return;
+    const size_t nchunks = atomic_load(&heap->nchunks);
+    for (size_t c = 0; c < nchunks && c < HEAP_MAX_CHUNKS; c++) {
+        arena_chunk_put((arena_chunk_t *) heap->chunks[c]);
+    }
+    table_free(heap, sizeof(heap_t));
+}
+
+static inline void print_alloc_stats(const int nthreads) {
+    fprintf(stderr, "thread    allocs        bytes  chunk hits  chunk misses  chunks freed  out buffers\n");
+    for (int t = 0; t < nthreads; t++) {
+        const alloc_stats_t *st = &g_alloc_stats[t];
+        fprintf(stderr, "%6d %9zu %12zu %11zu %13zu %13zu %12zu\n", t, st->allocs, st->bytes,
+                st->chunk_hits, st->chunk_misses, st->chunks_freed, st->outbufs);
+    }
+}
+
+
+static inline record_t *table_row(const table_t *table, const size_t i) {
+    return &table->segments[i >> SEGMENT_SHIFT]->rows[i & SEGMENT_MASK];
+}
+
+static inline char *table_line(const table_t *table, const record_t *record) {
+    return heap_ptr(table->heap, (uint64_t) record->line_hi << 32 | record->line);
+}
+
+// Field f (0-based) of a record of the table.
+static inline const char *table_field(const table_t *table, const record_t *record, const int f) {
+    return table_line(table, record) + record->fields[f];
+}
+
+// Column col (1-based) of a record, "" if the record has fewer fields.
+static inline const char *record_field(const table_t *table, const record_t *record, const int col) {
+    return col <= record->nfields ? table_field(table, record, col - 1) : "";
+}
+
+// Splits a line stored at the record's reference into fields.
+static inline void record_split(record_t *record, char *line) {
+    record->nfields = 0;
+    record->coded = 0;
+    char *save = NULL;
+    char *token = strtok_r(line, ",", &save);
+    while (token && record->nfields < MAX_FIELDS) {
+        if (token - line > UINT16_MAX) {
+            fprintf(stderr, "Line too long!\n");
+            exit(EXIT_FAILURE);
+        }
+        record->fields[record->nfields++] = (uint16_t) (token - line);
+        token = strtok_r(NULL, ",", &save);
+    }
+}
+
+static codec_t g_codecs[MAX_CODECS];
+static atomic_int g_ncodecs;
+typedef enum { COMPRESS_OFF, COMPRESS_FSST, COMPRESS_TYPED } compress_mode_t;
+
+static compress_mode_t g_compress = COMPRESS_OFF;
+
+static inline codec_t *codec_new(const char *source, const int column) {
+    const int slot = atomic_fetch_add(&g_ncodecs, 1);
+    if (slot >= MAX_CODECS) return NULL; // the column stays text
+    codec_t *codec = &g_codecs[slot];
+    codec->source = source;
+    codec->column = column;
+    return codec;
+}
+
+static inline uint64_t fsst_mask(const int len) {
+    return len == 8 ? UINT64_MAX : ((uint64_t) 1 << (8 * len)) - 1;
+}
+
+// Rebuilds the encoder index after the symbols changed.
+static inline void fsst_index(codec_t *codec) {
+    memset(codec->first, 0, sizeof(codec->first));
+    for (int s = 0; s < codec->nsymbols; s++) codec->first[(codec->symbols[s] & 0xff) + 1]++;
+    for (int c = 0; c < 256; c++) codec->first[c + 1] += codec->first[c];
+    uint16_t next[256];
+    memcpy(next, codec->first, sizeof(next));
+    for (int len = 8; len > 0; len--) {
+        for (int s = 0; s < codec->nsymbols; s++) {
+            if (codec->lens[s] == len) codec->order[next[codec->symbols[s] & 0xff]++] = (uint8_t) s;
+        }
+    }
+}
+
+// Code of the longest symbol at the start of src, or -1.
+static inline int fsst_match(const codec_t *codec, const char *src, const size_t len) {
+    uint64_t word = 0;
+    memcpy(&word, src, len < 8 ? len : 8);
+    const int c = (unsigned char) src[0];
+    for (int i = codec->first[c]; i < codec->first[c + 1]; i++) {
+        const int s = codec->order[i];
+        if (codec->lens[s] <= len && ((word ^ codec->symbols[s]) & fsst_mask(codec->lens[s])) == 0) return s;
+    }
+    return -1;
+}
+
+// Encodes len bytes into dst, which needs room for 2 * len bytes; returns the code length.
+static inline size_t fsst_encode(const codec_t *codec, const char *src, const size_t len, uint8_t *dst) {
+    uint8_t *out = dst;
+    for (size_t p = 0; p < len;) {
+        const int code = fsst_match(codec, src + p, len - p);
+        if (code >= 0) {
+            *out++ = (uint8_t) code;
+            p += codec->lens[code];
+        } else {
+            *out++ = FSST_ESCAPE;
+            *out++ = (uint8_t) src[p++];
+        }
+    }
+    return out - dst;
+}
+
+// Decodes n code bytes into dst, which needs 7 bytes of slack; returns the text length.
+static inline size_t fsst_decode(const codec_t *codec, const uint8_t *src, const size_t n, char *dst) {
+    char *out = dst;
+    for (size_t i = 0; i < n; i++) {
+        if (src[i] == FSST_ESCAPE) {
+            *out++ = (char) src[++i];
+        } else {
+            memcpy(out, &codec->symbols[src[i]], 8);
+            out += codec->lens[src[i]];
+        }
+    }
+    return out - dst;
+}
+
+typedef struct {
+    uint64_t symbol;
+    uint64_t gain;
+    int len;
+} fsst_candidate_t;
+
+static int fsst_candidate_by_symbol(const void *a, const void *b) {
+    const fsst_candidate_t *x = a, *y = b;
+    if (x->len != y->len) return x->len - y->len;
+    return x->symbol < y->symbol ? -1 : x->symbol > y->symbol;
+}
+
+static int fsst_candidate_by_gain(const void *a, const void *b) {
+    const fsst_candidate_t *x = a, *y = b;
+    return x->gain < y->gain ? 1 : x->gain > y->gain ? -1 : 0;
+}
+
+// Builds the symbol table from sample strings (lens[i] bytes each, back to back in text).
+// Every round encodes the sample with the current symbols, counts how often each symbol
+// and each pair of adjacent symbols occurs, and keeps the 255 candidates that save the
+// most bytes; a pair becomes the concatenated symbol. Codes 256 + b stand for literal bytes.
+static inline void fsst_train(codec_t *codec, const char *text, const uint16_t *lens, const size_t nsamples) {
+    uint32_t *pairs = malloc(512 * 512 * sizeof(uint32_t));
+    fsst_candidate_t *candidates = malloc((512 + 512 * 512) * sizeof(fsst_candidate_t));
+    if (!pairs || !candidates) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    codec->nsymbols = 0;
+    fsst_index(codec);
+    for (int round = 0; round < 5; round++) {
+        uint32_t counts[512] = {0};
+        memset(pairs, 0, 512 * 512 * sizeof(uint32_t));
+        const char *s = text;
+        for (size_t i = 0; i < nsamples; s += lens[i++]) {
+            int prev = -1;
+            for (size_t p = 0; p < lens[i];) {
+                int code = fsst_match(codec, s + p, lens[i] - p);
+                p += code >= 0 ? codec->lens[code] : 1;
+                if (code < 0) code = 256 + (unsigned char) s[p - 1];
+                counts[code]++;
+                if (prev >= 0) pairs[prev * 512 + code]++;
+                prev = code;
+            }
+        }
+
+        size_t n = 0;
+        uint64_t symbol[512];
+        int len[512];
+        for (int c = 0; c < 512; c++) {
+            symbol[c] = c < codec->nsymbols ? codec->symbols[c] : (uint64_t) (c - 256);
+            len[c] = c < codec->nsymbols ? codec->lens[c] : c < 256 ? 0 : 1;
+            if (counts[c] && len[c]) candidates[n++] = (fsst_candidate_t) {symbol[c], (uint64_t) counts[c] * len[c], len[c]};
+        }
+        for (int a = 0; a < 512; a++) {
+            for (int b = 0; b < 512; b++) {
+                const uint32_t count = pairs[a * 512 + b];
+                if (!count || len[a] + len[b] > 8) continue;
+                const int l = len[a] + len[b];
+                candidates[n++] = (fsst_candidate_t) {symbol[a] | symbol[b] << (8 * len[a]), (uint64_t) count * l, l};
+            }
+        }
+
+        // merge duplicates, then keep the best
+        qsort(candidates, n, sizeof(fsst_candidate_t), fsst_candidate_by_symbol);
+        size_t unique = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (unique > 0 && candidates[unique - 1].len == candidates[i].len &&
+                candidates[unique - 1].symbol == candidates[i].symbol) {
+                candidates[unique - 1].gain += candidates[i].gain;
+            } else {
+                candidates[unique++] = candidates[i];
+            }
+        }
+        qsort(candidates, unique, sizeof(fsst_candidate_t), fsst_candidate_by_gain);
+        codec->nsymbols = unique < FSST_ESCAPE ? (int) unique : FSST_ESCAPE;
+        for (int c = 0; c < codec->nsymbols; c++) {
+            codec->symbols[c] = candidates[c].symbol;
+            codec->lens[c] = (uint8_t) candidates[c].len;
+        }
+        fsst_index(codec);
+    }
+    free(pairs);
+    free(candidates);
+}
+
+// Parses text the codec type writes back identically: integers without leading zeros or
+// "-0", decimals with exactly scale digits after the point and dates as YYYY-MM-DD.
+static inline int number_parse(const codec_type_t type, const int scale, const char *text, const size_t len,
+                               int64_t *value) {
+    if (type == CODEC_DATE) {
+        if (len != 10 || text[4] != '-' || text[7] != '-') return 0;
+        int digits[8], n = 0;
+        for (size_t i = 0; i < len; i++) {
+            if (i == 4 || i == 7) continue;
+            if (text[i] < '0' || text[i] > '9') return 0;
+            digits[n++] = text[i] - '0';
+        }
+        const int year = digits[0] * 1000 + digits[1] * 100 + digits[2] * 10 + digits[3];
+        const int month = digits[4] * 10 + digits[5], day = digits[6] * 10 + digits[7];
+        if (month < 1 || month > 12 || day < 1 || day > 31) return 0;
+        *value = ((int64_t) year * 16 + month) * 32 + day;
+        return 1;
+    }
+
+    const int negative = len > 0 && text[0] == '-';
+    size_t i = negative, digits = 0;
+    uint64_t v = 0;
+    for (; i < len && text[i] >= '0' && text[i] <= '9'; i++, digits++) v = v * 10 + (text[i] - '0');
+    if (digits == 0 || digits > 18 || (digits > 1 && text[negative] == '0')) return 0;
+    if (type == CODEC_DECIMAL) {
+        if (i == len || text[i] != '.' || len - i - 1 != (size_t) scale || digits + scale > 18) return 0;
+        for (i++; i < len; i++) {
+            if (text[i] < '0' || text[i] > '9') return 0;
+            v = v * 10 + (text[i] - '0');
+        }
+    }
+    if (i != len || (negative && v == 0)) return 0;
+    *value = negative ? -(int64_t) v : (int64_t) v;
+    return 1;
+}
+
+// Writes the text of a value that number_parse accepted; returns its length.
+static inline size_t number_format(const codec_t *codec, const int64_t value, char *dst) {
+    char digits[24];
+    int n = 0;
+    if (codec->type == CODEC_DATE) {
+        const int day = value & 31, month = value >> 5 & 15, year = (int) (value >> 9);
+        const int parts[8] = {year / 1000, year / 100 % 10, year / 10 % 10, year % 10,
+                              month / 10, month % 10, day / 10, day % 10};
+        for (int i = 0, p = 0; i < 10; i++) dst[i] = i == 4 || i == 7 ? '-' : (char) ('0' + parts[p++]);
+        return 10;
+    }
+    uint64_t v = value < 0 ? -(uint64_t) value : (uint64_t) value;
+    const int scale = codec->type == CODEC_DECIMAL ? codec->scale : 0;
+    do {
+        digits[n++] = (char) ('0' + v % 10);
+        v /= 10;
+        if (n == scale) digits[n++] = '.';
+    } while (v || (scale && n <= scale + 1)); // decimals below 1 start with "0."
+    if (value < 0) digits[n++] = '-';
+    for (int i = 0; i < n; i++) dst[i] = digits[n - 1 - i];
+    return n;
+}
+
+// Encodes text into width bytes if the codec reproduces it and it lies in the frame.
+static inline int number_encode(const codec_t *codec, const char *text, const size_t len, uint8_t *dst) {
+    int64_t value;
+    if (!number_parse(codec->type, codec->scale, text, len, &value) || value < codec->base) return 0;
+    const uint64_t offset = (uint64_t) (value - codec->base);
+    if (codec->width < 8 && offset >> (8 * codec->width)) return 0;
+    for (int b = 0; b < codec->width; b++) dst[b] = (uint8_t) (offset >> (8 * b));
+    return 1;
+}
+
+static inline size_t number_decode(const codec_t *codec, const uint8_t *src, char *dst) {
+    uint64_t offset = 0;
+    for (int b = 0; b < codec->width; b++) offset |= (uint64_t) src[b] << (8 * b);
+    return number_format(codec, codec->base + (int64_t) offset, dst);
+}
+
+static int int64_compare(const void *a, const void *b) {
+    const int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+// Picks the number type that reproduces the most samples, if that is at least half of them,
+// and the frame that stores the samples in the fewest bytes: a narrower frame that leaves a
+// few outliers as text can beat one that covers them all. Returns 0 for string columns.
+static inline int number_infer(codec_t *codec, const char *text, const uint16_t *lens, const size_t nsamples) {
+    size_t best = 0, text_bytes = 0;
+    for (int candidate = 0; candidate < 8; candidate++) {
+        // integers, decimals with 1 to 6 digits after the point, dates
+        const codec_type_t type = candidate == 0 ? CODEC_INT : candidate == 7 ? CODEC_DATE : CODEC_DECIMAL;
+        const int scale = type == CODEC_DECIMAL ? candidate : 0;
+        size_t count = 0;
+        const char *sample = text;
+        for (size_t i = 0; i < nsamples; sample += lens[i++]) {
+            int64_t value;
+            count += number_parse(type, scale, sample, lens[i], &value);
+        }
+        if (count <= best) continue;
+        best = count;
+        codec->type = type;
+        codec->scale = scale;
+    }
+    if (best == 0 || 2 * best < nsamples) {
+        codec->type = CODEC_FSST;
+        return 0;
+    }
+
+    int64_t *values = malloc(best * sizeof(int64_t));
+    if (!values) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+    size_t n = 0;
+    const char *sample = text;
+    for (size_t i = 0; i < nsamples; sample += lens[i++]) {
+        if (number_parse(codec->type, codec->scale, sample, lens[i], &values[n])) {
+            n++;
+            text_bytes += lens[i] + 1;
+        }
+    }
+    qsort(values, n, sizeof(int64_t), int64_compare);
+    size_t best_cost = SIZE_MAX;
+    for (int width = 1; width <= 8; width++) {
+        // widest run of sorted values that fits the frame, two pointers
+        size_t covered = 0, first = 0;
+        for (size_t lo = 0, hi = 0; lo < n; lo++) {
+            if (hi < lo) hi = lo;
+            while (hi + 1 < n && (width == 8 || (uint64_t) (values[hi + 1] - values[lo]) >> (8 * width) == 0)) hi++;
+            if (hi - lo + 1 > covered) {
+                covered = hi - lo + 1;
+                first = lo;
+            }
+        }
+        const size_t cost = covered * width + (n - covered) * text_bytes / n;
+        if (cost < best_cost) {
+            best_cost = cost;
+            codec->width = width;
+            codec->base = values[first];
+        }
+    }
+    free(values);
+    return 1;
+}
+
+// Lengths below 0x8000: one byte up to 0x7f, two bytes from 0x80 on.
+static inline size_t put_len(uint8_t *dst, const size_t len) {
+    if (len < 0x80) {
+        dst[0] = (uint8_t) len;
+        return 1;
+    }
+    dst[0] = (uint8_t) (0x80 | len >> 8);
+    dst[1] = (uint8_t) len;
+    return 2;
+}
+
+static inline size_t get_len(const uint8_t *src, size_t *len) {
+    if (src[0] < 0x80) {
+        *len = src[0];
+        return 1;
+    }
+    *len = (size_t) (src[0] & 0x7f) << 8 | src[1];
+    return 2;
+}
+
+// Bytes field f takes in the line: text and terminator, code length and codes, or a number.
+static inline size_t field_stored_size(const table_t *table, const record_t *record, const int f) {
+    const char *field = table_field(table, record, f);
+    if (!(record->coded >> f & 1)) return strlen(field) + 1;
+    if (table->codecs[f]->type != CODEC_FSST) return table->codecs[f]->width;
+    size_t n;
+    const size_t header = get_len((const uint8_t *) field, &n);
+    return header + n;
+}
+
+// Upper bound of the text length of field f.
+static inline size_t field_text_bound(const table_t *table, const record_t *record, const int f) {
+    const char *field = table_field(table, record, f);
+    if (!(record->coded >> f & 1)) return strlen(field);
+    if (table->codecs[f]->type != CODEC_FSST) return 21; // sign, 18 digits and the point
+    size_t n;
+    get_len((const uint8_t *) field, &n);
+    return 8 * n;
+}
+
+// Writes the text of field f to dst, which needs 7 bytes more than the text; returns its length.
+static inline size_t field_text(const table_t *table, const record_t *record, const int f, char *dst) {
+    const char *field = table_field(table, record, f);
+    if (record->coded >> f & 1) {
+        if (table->codecs[f]->type != CODEC_FSST) return number_decode(table->codecs[f], (const uint8_t *) field, dst);
+        size_t n;
+        const size_t header = get_len((const uint8_t *) field, &n);
+        return fsst_decode(table->codecs[f], (const uint8_t *) field + header, n, dst);
+    }
+    const size_t len = strlen(field);
+    memcpy(dst, field, len);
+    return len;
+}
+
+static inline void print_codec_stats(void) {
+    static const char *names[] = {"fsst", "int", "decimal", "date"};
+    const int ncodecs = atomic_load(&g_ncodecs) < MAX_CODECS ? atomic_load(&g_ncodecs) : MAX_CODECS;
+    for (int c = 0; c < ncodecs; c++) {
+        const codec_t *codec = &g_codecs[c];
+        const size_t raw = atomic_load(&codec->raw_bytes), coded = atomic_load(&codec->coded_bytes);
+        fprintf(stderr, "%s %s column %d: ", names[codec->type], codec->source, codec->column);
+        if (codec->type == CODEC_FSST) fprintf(stderr, "%d symbols", codec->nsymbols);
+        else fprintf(stderr, "base %lld, %d bytes", (long long) codec->base, codec->width);
+        fprintf(stderr, ", %zu -> %zu bytes (%.2fx)\n", raw, coded, coded ? (double) raw / coded : 0.0);
+    }
+}
+
+static inline segment_t *segment_alloc(void) {
+    segment_t *segment = table_alloc(sizeof(segment_t));
+    if (!segment) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+    return segment;
+}
+
+static inline void segment_free(segment_t *segment) {
+    table_free(segment, sizeof(segment_t));
+}
+
+static inline void table_add_segment(table_t *table, segment_t *segment) {
+    if (table->nsegments == table->capacity) {
+        table->capacity = table->capacity ? 2 * table->capacity : 16;
+        table->segments = realloc(table->segments, table->capacity * sizeof(segment_t *));
+        if (!table->segments) {
+            fprintf(stderr, "Out of memory!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    table->segments[table->nsegments++] = segment;
+}
+
+// Returns the slot of a new row at the end of the table.
+static inline record_t *table_append(table_t *table) {
+    if (table->count == table->nsegments * SEGMENT_ROWS) {
+        table_add_segment(table, segment_alloc());
+    }
+    return table_row(table, table->count++);
+}
+
+// Moves tables that threads filled independently into one. The parts share the heap of
+// the table. Full segments are taken over as they are and the rows of the partial last
+// segments are packed together, so rows keep their order within a part but not across parts.
+static inline void table_merge(table_t *table, table_t *parts, const int nparts) {
+    segment_t *tail = NULL;
+    size_t tail_rows = 0;
+
+    for (int p = 0; p < nparts; p++) {
+        const size_t full = parts[p].count >> SEGMENT_SHIFT;
+        for (size_t s = 0; s < full; s++) {
+            table_add_segment(table, parts[p].segments[s]);
+        }
+
+        size_t rest = parts[p].count & SEGMENT_MASK;
+        if (rest) {
+            segment_t *segment = parts[p].segments[full];
+            if (!tail) {
+                tail = segment;
+                tail_rows = rest;
+            } else {
+                // Top up the tail from the end of this segment
+                const size_t move = rest < SEGMENT_ROWS - tail_rows ? rest : SEGMENT_ROWS - tail_rows;
+                memcpy(&tail->rows[tail_rows], &segment->rows[rest - move], move * sizeof(record_t));
+                tail_rows += move;
+                rest -= move;
+                if (tail_rows == SEGMENT_ROWS) {
+                    table_add_segment(table, tail);
+                    tail = rest ? segment : NULL;
+                    tail_rows = rest;
+                }
+                if (!rest) segment_free(segment);
+            }
+        }
+
+        table->count += parts[p].count;
+        free(parts[p].segments);
+        parts[p] = (table_t) {0};
+    }
+    if (tail) table_add_segment(table, tail);
+}
+
+typedef struct {
+    table_t *table;
+    table_t *parts;
+    size_t *offsets;
+} concat_job_t;
+
+static void concat_part(void *arg, const int part) {
+    const concat_job_t *job = arg;
+    const table_t *src = &job->parts[part];
+    size_t dst = job->offsets[part];
+    size_t i = 0;
+    while (i < src->count) {
+        // Copy up to the next segment boundary of either side
+        size_t run = src->count - i;
+        if (run > SEGMENT_ROWS - (i & SEGMENT_MASK)) run = SEGMENT_ROWS - (i & SEGMENT_MASK);
+        if (run > SEGMENT_ROWS - (dst & SEGMENT_MASK)) run = SEGMENT_ROWS - (dst & SEGMENT_MASK);
+        memcpy(table_row(job->table, dst), table_row(src, i), run * sizeof(record_t));
+        i += run;
+        dst += run;
+    }
+}
+
+static inline void parallel_for(int n, void (*fn)(void *arg, int index), void *arg);
+
+// Appends the parts to the table in order, copying their rows in parallel. The parts
+// share the heap of the table.
+static inline void table_concat(table_t *table, table_t *parts, const int nparts) {
+    size_t offsets[nparts];
+    for (int p = 0; p < nparts; p++) {
+        offsets[p] = table->count;
+        table->count += parts[p].count;
+    }
+    while (table->nsegments * SEGMENT_ROWS < table->count) {
+        table_add_segment(table, segment_alloc());
+    }
+
+    concat_job_t job = {.table = table, .parts = parts, .offsets = offsets};
+    parallel_for(nparts, concat_part, &job);
+
+    for (int p = 0; p < nparts; p++) {
+        for (size_t s = 0; s < parts[p].nsegments; s++) segment_free(parts[p].segments[s]);
+        free(parts[p].segments);
+        parts[p] = (table_t) {0};
+    }
+}
+
+// Frees the segments that lie completely before row, for consumers that stream
+// through a table they are the last user of.
+static inline void table_release_before(table_t *table, const size_t row) {
+    while (table->released < (row >> SEGMENT_SHIFT)) {
+        segment_free(table->segments[table->released]);
+        table->segments[table->released++] = NULL;
+    }
+}
+
+static inline void key_column_free(key_column_t *keys) {
+    free(keys->data);
+    free(keys->restarts);
+    *keys = (key_column_t) {0};
+}
+
+static inline void hash_column_free(hash_column_t *hashes) {
+    table_free(hashes->values, hashes->count * sizeof(uint32_t));
+    *hashes = (hash_column_t) {0};
+}
+
+static inline void hash_index_free(hash_index_t *index) {
+    if (index->slots) table_free((void *) index->slots, (index->mask + 1) * sizeof(uint64_t));
+    *index = (hash_index_t) {0};
+}
+
+static inline void mph_free(mph_t *mph) {
+    free(mph->bits);
+    free(mph->ranks);
+    for (size_t j = 0; j < mph->nfallback; j++) free(mph->fallback_keys[j]);
+    free(mph->fallback_hashes);
+    free(mph->fallback_keys);
+    *mph = (mph_t) {0};
+}
+
+static inline void mph_index_free(mph_index_t *index) {
+    mph_free(&index->mph);
+    free(index->entries);
+    free(index->next);
+    *index = (mph_index_t) {0};
+}
+
+static inline void learned_index_free(learned_index_t *model) {
+    for (size_t s = 0; s < model->nsegments; s++) {
+        if (model->segments[s].inner) learned_index_free(model->segments[s].inner);
+        free(model->segments[s].inner);
+    }
+    free(model->segments);
+    if (model->prefixes) table_free(model->prefixes, model->count * sizeof(uint64_t));
+    free(model->radix);
+    *model = (learned_index_t) {0};
+}
+
+static inline void free_table(table_t *table) {
+    for (size_t s = table->released; s < table->nsegments; s++) {
+        segment_free(table->segments[s]);
+    }
+    free(table->segments);
+    heap_free(table->heap);
+    key_column_free(&table->keys);
+    hash_column_free(&table->hashes);
+    hash_index_free(&table->index);
+    mph_index_free(&table->mph);
+    learned_index_free(&table->model);
+    *table = (table_t) {0};
+}
+
+// Task graph: every stage of the pipeline is a task that becomes ready once all of
+// its inputs are done. A task's output is freed as soon as its last consumer finishes.
+typedef struct task task_t;
+
+struct task {
+    const char *name;
+    void (*run)(task_t *task);
+    task_t *inputs[2];
+    int ninputs;
+    task_t *dependents[MAX_TASKS];
+    int ndependents;
+    atomic_int pending;   // inputs that are not finished yet
+    atomic_int consumers; // dependents that still need our output
+    table_t out;
+
+    // Stage parameters
+    const char *path;
+    int left_col;
+    int right_col;
+    int sort_col; // order the output needs for the join that reads it, 0 = any (see plan_orders)
+    int hash_col; // column a hash-based consumer needs the hashes of, 0 = none
+    int index_col; // column a hash join needs a hash index on, 0 = none
+    int mph_col;  // column a hash join needs a perfect hash index on, 0 = none
+    int model_col; // column a learned join needs a learned index on, 0 = none
+    int hash;     // join: probe a hash index of the right input instead of merging
+    int learned;  // join: look the left rows up in the sorted right input instead of merging
+    int filter_col; // load: only rows whose key is in this column of the input are needed, 0 = all
+    unsigned text_cols; // columns (bit col) that joins read as keys, kept as text (see plan_text_cols)
+    int fields;   // fields of the output rows, from the first lines of the files; 0 = unknown
+    int part;     // slice of the left input handled by this task
+    int nparts;
+    struct parallel_job *job; // set on parallel_for helpers
+
+    task_t *next; // ready stack link
+};
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    task_t *ready;  // LIFO, so consumers run right after their inputs and memory is freed early
+    int remaining;  // tasks not finished yet
+    int nthreads;
+} scheduler_t;
+
+static _Thread_local scheduler_t *tl_sched;
+static int g_nthreads = 1;
+
+// A task can split its own work with parallel_for: idle workers pick up helper tasks
+// that claim indices until none are left.
+typedef struct parallel_job {
+    void (*fn)(void *arg, int index);
+    void *arg;
+    int n;
+    atomic_int next;
+    int helpers_done; // protected by the scheduler lock
+} parallel_job_t;
+
+static inline void parallel_work(parallel_job_t *job) {
+    int index;
+    while ((index = atomic_fetch_add(&job->next, 1)) < job->n) {
+        job->fn(job->arg, index);
+    }
+}
+
+static inline void task_depends(task_t *task, task_t *input) {
+    task->inputs[task->ninputs++] = input;
+    input->dependents[input->ndependents++] = task;
+    atomic_fetch_add(&task->pending, 1);
+    atomic_fetch_add(&input->consumers, 1);
+}
+
+static inline void scheduler_push(scheduler_t *sched, task_t *task) {
+    pthread_mutex_lock(&sched->lock);
+    task->next = sched->ready;
+    sched->ready = task;
+    pthread_cond_signal(&sched->cond);
+    pthread_mutex_unlock(&sched->lock);
+}
+
+static inline void task_finish(scheduler_t *sched, task_t *task) {
+    for (int d = 0; d < task->ndependents; d++) {
+        if (atomic_fetch_sub(&task->dependents[d]->pending, 1) == 1) {
+            scheduler_push(sched, task->dependents[d]);
+        }
+    }
+
+    for (int in = 0; in < task->ninputs; in++) {
+        task_t *input = task->inputs[in];
+        if (atomic_fetch_sub(&input->consumers, 1) == 1) {
+            free_table(&input->out);
+        }
+    }
+
+    pthread_mutex_lock(&sched->lock);
+    if (--sched->remaining == 0) {
+        pthread_cond_broadcast(&sched->cond);
+    }
+    pthread_mutex_unlock(&sched->lock);
+}
+
+typedef struct {
+    scheduler_t *sched;
+    int index;
+} worker_t;
+
+static void *scheduler_worker(void *arg) {
+    const worker_t *worker = arg;
+    scheduler_t *sched = worker->sched;
+    thread_bind(ROLE_WORKER, worker->index);
+    tl_stats = &g_alloc_stats[worker->index];
+    tl_sched = sched;
+
+    for (;;) {
+        pthread_mutex_lock(&sched->lock);
+        while (!sched->ready && sched->remaining > 0) {
+            pthread_cond_wait(&sched->cond, &sched->lock);
+        }
+        task_t *task = sched->ready;
+        if (!task) {
+            pthread_mutex_unlock(&sched->lock);
+            arena_cache_release();
+            return NULL;
+        }
+        sched->ready = task->next;
+        pthread_mutex_unlock(&sched->lock);
+
+        if (task->job) {
+            // parallel_for helper; its task lives on the caller's stack, so don't touch it afterwards
+            parallel_job_t *job = task->job;
+            parallel_work(job);
+            pthread_mutex_lock(&sched->lock);
+            sched->remaining--;
+            job->helpers_done++;
+            pthread_cond_broadcast(&sched->cond);
+            pthread_mutex_unlock(&sched->lock);
+            continue;
+        }
+
+        task->run(task);
+        task_finish(sched, task);
+    }
+}
+
+// Runs fn(arg, 0..n-1) on the calling worker and any idle ones, returns once all calls are done.
+static inline void parallel_for(const int n, void (*fn)(void *arg, int index), void *arg) {
+    scheduler_t *sched = tl_sched;
+    const int nhelpers = sched ? (n - 1 < sched->nthreads - 1 ? n - 1 : sched->nthreads - 1) : 0;
+    if (nhelpers <= 0) {
+        for (int i = 0; i < n; i++) fn(arg, i);
+        return;
+    }
+
+    parallel_job_t job = {.fn = fn, .arg = arg, .n = n, .helpers_done = 0};
+    atomic_init(&job.next, 0);
+    task_t helpers[nhelpers];
+
+    pthread_mutex_lock(&sched->lock);
+    for (int h = 0; h < nhelpers; h++) {
+        helpers[h] = (task_t) {.name = "parallel", .job = &job, .next = sched->ready};
+        sched->ready = &helpers[h];
+    }
+    sched->remaining += nhelpers;
+    pthread_cond_broadcast(&sched->cond);
+    pthread_mutex_unlock(&sched->lock);
+
+    parallel_work(&job);
+
+    // Withdraw the helpers nobody has picked up and wait for the others
+    pthread_mutex_lock(&sched->lock);
+    int withdrawn = 0;
+    for (task_t **link = &sched->ready; *link;) {
+        if ((*link)->job == &job) {
+            *link = (*link)->next;
+            withdrawn++;
+        } else {
+            link = &(*link)->next;
+        }
+    }
+    sched->remaining -= withdrawn;
+    while (job.helpers_done < nhelpers - withdrawn) {
+        pthread_cond_wait(&sched->cond, &sched->lock);
+    }
+    pthread_mutex_unlock(&sched->lock);
+}
+
+// Runs the graph on nthreads threads, the calling thread being one of them.
+static inline void scheduler_run(task_t *tasks, const int ntasks, const int nthreads) {
+    scheduler_t sched = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+        .ready = NULL,
+        .remaining = ntasks,
+        .nthreads = nthreads,
+    };
+
+    // Pushed in reverse so the first source task is started first
+    for (int t = ntasks - 1; t >= 0; t--) {
+        if (atomic_load(&tasks[t].pending) == 0) {
+            tasks[t].next = sched.ready;
+            sched.ready = &tasks[t];
+        }
+    }
+
+    pthread_t threads[nthreads];
+    worker_t workers[nthreads];
+    for (int t = 0; t < nthreads; t++) {
+        workers[t] = (worker_t) {.sched = &sched, .index = t};
+    }
+    for (int t = 1; t < nthreads; t++) {
+        if (pthread_create(&threads[t], NULL, scheduler_worker, &workers[t]) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    scheduler_worker(&workers[0]);
+    for (int t = 1; t < nthreads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    tl_sched = NULL;
+}
+
+// Stores a line with each field that has a codec (FSST or number) encoded by it, split like record_split.
+static inline void store_coded_line(table_t *table, const char *text, const size_t length, codec_counts_t *counts) {
+    uint8_t stack[1024];
+    const size_t bound = 2 * length + 10 * MAX_FIELDS;
+    uint8_t *buf = bound <= sizeof(stack) ? stack : malloc(bound);
+    if (!buf) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    record_t *record = table_append(table);
+    record->nfields = 0;
+    record->coded = 0;
+    size_t pos = 0;
+    for (size_t p = 0; p < length && record->nfields < MAX_FIELDS;) {
+        if (text[p] == DELIM) {
+            p++;
+            continue;
+        }
+        size_t end = p;
+        while (end < length && text[end] != DELIM) end++;
+        if (pos > UINT16_MAX) {
+            fprintf(stderr, "Line too long!\n");
+            exit(EXIT_FAILURE);
+        }
+        const int f = record->nfields++;
+        record->fields[f] = (uint16_t) pos;
+        codec_t *codec = table->codecs[f];
+        if (codec && codec->type != CODEC_FSST && number_encode(codec, text + p, end - p, buf + pos)) {
+            pos += codec->width;
+            record->coded |= 1 << f;
+            counts[f].raw += end - p;
+            counts[f].coded += codec->width;
+        } else if (codec && codec->type != CODEC_FSST) {
+            memcpy(buf + pos, text + p, end - p); // the exceptions stay text
+            pos += end - p;
+            buf[pos++] = '\0';
+            counts[f].raw += end - p;
+            counts[f].coded += end - p + 1;
+        } else if (codec) {
+            // encode behind room for the longest length header, then close the gap
+            const size_t n = fsst_encode(codec, text + p, end - p, buf + pos + 2);
+            const size_t header = put_len(buf + pos, n);
+            memmove(buf + pos + header, buf + pos + 2, n);
+            pos += header + n;
+            record->coded |= 1 << f;
+            counts[f].raw += end - p;
+            counts[f].coded += header + n;
+        } else {
+            memcpy(buf + pos, text + p, end - p);
+            pos += end - p;
+            buf[pos++] = '\0';
+        }
+        p = end;
+    }
+
+    memcpy(heap_alloc(table, pos ? pos : 1, record), buf, pos);
+    if (buf != stack) free(buf);
+}
+
+// Kernels with SIMD variants come as a table indexed by isa_t, one entry per instruction
+// set they have a variant for. At startup the best variant the cpu runs is selected for
+// every kernel; --force-isa caps the instruction set, to compare variants on one machine.
+typedef enum { ISA_SCALAR, ISA_SSE42, ISA_AVX2, ISA_AVX512, NISAS } isa_t;
+
+static const char *const g_isa_names[NISAS] = {"scalar", "sse4.2", "avx2", "avx512"};
+static isa_t g_isa;
+
+static inline int isa_supported(const isa_t isa) {
+    __builtin_cpu_init();
+    switch (isa) {
+        case ISA_SSE42: return __builtin_cpu_supports("sse4.2");
+        case ISA_AVX2: return __builtin_cpu_supports("avx2");
+        case ISA_AVX512: return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+        default: return 1;
+    }
+}
+
+// Index of the best variant not above g_isa in a kernel table; missing variants have no name.
+static inline int isa_variant(const char *const *names, const size_t stride) {
+    int isa = g_isa;
+    while (isa > ISA_SCALAR && !*(const char *const *) ((const char *) names + isa * stride)) isa--;
+    return isa;
+}
+
+#define ISA_SELECT(variants) (&(variants)[isa_variant(&(variants)[0].name, sizeof((variants)[0]))])
+
+// Finds the end of a line: the first '\n' in [p, end), or end. Full vectors are compared
+// while they fit, the rest byte by byte (AVX-512 loads it masked).
+typedef struct {
+    const char *name;
+    const char *(*find_eol)(const char *p, const char *end);
+} scan_kernel_t;
+
+static const scan_kernel_t *g_scan_kernel;
+
+static const char *find_eol_scalar(const char *p, const char *end) {
+    while (p < end && *p != '\n') p++;
+    return p;
+}
+
+__attribute__((target("sse4.2")))
+static const char *find_eol_sse42(const char *p, const char *end) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; end - p >= 16; p += 16) {
+        const unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) p), newline));
+        if (mask) return p + __builtin_ctz(mask);
+    }
+    return find_eol_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char *find_eol_avx2(const char *p, const char *end) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    for (; end - p >= 32; p += 32) {
+        const unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) p), newline));
+        if (mask) return p + __builtin_ctz(mask);
+    }
+    return find_eol_scalar(p, end);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static const char *find_eol_avx512(const char *p, const char *end) {
+    const __m512i newline = _mm512_set1_epi8('\n');
+    for (; p < end; p += 64) {
+        const __mmask64 valid = end - p >= 64 ? ~(__mmask64) 0 : ((__mmask64) 1 << (end - p)) - 1;
+        const __mmask64 mask = _mm512_mask_cmpeq_epi8_mask(valid, _mm512_maskz_loadu_epi8(valid, p), newline);
+        if (mask) return p + __builtin_ctzll(mask);
+    }
+    return end;
+}
+
+static const scan_kernel_t g_scan_kernels[NISAS] = {
+    [ISA_SCALAR] = {"scalar", find_eol_scalar},
+    [ISA_SSE42] = {"sse4.2", find_eol_sse42},
+    [ISA_AVX2] = {"avx2", find_eol_avx2},
+    [ISA_AVX512] = {"avx512", find_eol_avx512},
+};
+
+// Key hashes are CRC32C (Castagnoli) over the key length and then the key, 8 bytes at a time
+// with the last word zero padded. The table-driven variant computes the same hashes as
+// the crc32 instruction, so hashes stay valid whichever variant computed them.
+typedef struct {
+    const char *name;
+    uint32_t (*hash)(const char *key, size_t len);
+    // Hashes column col of rows [begin, end) into out[0 .. end - begin)
+    void (*hash_rows)(const table_t *table, int col, size_t begin, size_t end, uint32_t *out);
+} hash_kernel_t;
+
+static const hash_kernel_t *g_hash_kernel;
+static uint32_t g_crc32c_table[8][256]; // slicing by 8
+
+static inline void crc32c_init(void) {
+    for (uint32_t b = 0; b < 256; b++) {
+        uint32_t crc = b;
+        for (int k = 0; k < 8; k++) crc = crc & 1 ? crc >> 1 ^ 0x82f63b78 : crc >> 1;
+        g_crc32c_table[0][b] = crc;
+    }
+    for (int t = 1; t < 8; t++) {
+        for (int b = 0; b < 256; b++) {
+            g_crc32c_table[t][b] = g_crc32c_table[t - 1][b] >> 8 ^ g_crc32c_table[0][g_crc32c_table[t - 1][b] & 0xff];
+        }
+    }
+}
+
+static inline uint32_t crc32c_word_scalar(const uint32_t crc, const uint64_t word) {
+    const uint64_t x = word ^ crc;
+    return g_crc32c_table[7][x & 0xff] ^ g_crc32c_table[6][x >> 8 & 0xff] ^
+           g_crc32c_table[5][x >> 16 & 0xff] ^ g_crc32c_table[4][x >> 24 & 0xff] ^
+           g_crc32c_table[3][x >> 32 & 0xff] ^ g_crc32c_table[2][x >> 40 & 0xff] ^
+           g_crc32c_table[1][x >> 48 & 0xff] ^ g_crc32c_table[0][x >> 56];
+}
+
+#define crc32c_word_sse42(crc, word) ((uint32_t) _mm_crc32_u64((crc), (word)))
+
+#define DEFINE_HASH_KERNEL(isa, TARGET)                                                                \
+    TARGET static uint32_t hash_key_##isa(const char *key, const size_t len) {                         \
+        uint32_t crc = crc32c_word_##isa(~0u, len);                                                    \
+        size_t i = 0;                                                                                  \
+        for (; i + 8 <= len; i += 8) {                                                                 \
+            uint64_t word;                                                                             \
+            memcpy(&word, key + i, 8);                                                                 \
+            crc = crc32c_word_##isa(crc, word);                                                        \
+        }                                                                                              \
+        if (i < len) {                                                                                 \
+            uint64_t word = 0;                                                                         \
+            memcpy(&word, key + i, len - i);                                                           \
+            crc = crc32c_word_##isa(crc, word);                                                        \
+        }                                                                                              \
+        return ~crc;                                                                                   \
+    }                                                                                                  \
+    TARGET static void hash_rows_##isa(const table_t *table, const int col, const size_t begin,        \
+                                       const size_t end, uint32_t *out) {                              \
+        for (size_t i = begin; i < end; i++) {                                                         \
+            const char *key = record_field(table, table_row(table, i), col);                           \
+            out[i - begin] = hash_key_##isa(key, strlen(key));                                         \
+        }                                                                                              \
+    }
+
+DEFINE_HASH_KERNEL(scalar, )
+DEFINE_HASH_KERNEL(sse42, __attribute__((target("sse4.2"))))
+
+static const hash_kernel_t g_hash_kernels[NISAS] = {
+    [ISA_SCALAR] = {"crc32c-table", hash_key_scalar, hash_rows_scalar},
+    [ISA_SSE42] = {"crc32c-sse4.2", hash_key_sse42, hash_rows_sse42},
+};
+
+// Parses the complete lines in [begin, end) and appends them to table.
+static inline void parse_lines(const char *begin, const char *end, table_t *table) {
+    const char *line_start = begin;
+    const char *line_end = begin;
+    codec_counts_t counts[MAX_FIELDS] = {0};
+    codec_counts_t *coded = NULL;
+    for (int f = 0; f < MAX_FIELDS; f++) {
+        if (table->codecs[f]) coded = counts;
+    }
+
+    while (line_end < end) {
+        // Find the end of the line
+        line_end = g_scan_kernel->find_eol(line_end, end);
+
+        // Determine line length and handle edge cases
+        size_t line_length = line_end - line_start;
+        if (line_length > 0) {
+            // Remove trailing carriage return if any
+            if (line_end > line_start && *(line_end - 1) == '\r') {
+                line_length--;
+            }
+
+            if (coded) {
+                store_coded_line(table, line_start, line_length, coded);
+            } else {
+                record_t *record = table_append(table);
+
+                // Allocate memory for the line from the table's heap and copy its contents
+                char *line = heap_alloc(table, line_length + 1, record); // +1 for null terminator
+                memcpy(line, line_start, line_length);
+                line[line_length] = '\0'; // Null-terminate the string
+
+                // Split into fields
+                record_split(record, line);
+            }
+        }
+
+        // Move to the next line
+        line_end++;
+        line_start = line_end;
+    }
+
+    for (int f = 0; coded && f < MAX_FIELDS; f++) {
+        if (!table->codecs[f]) continue;
+        atomic_fetch_add(&table->codecs[f]->raw_bytes, counts[f].raw);
+        atomic_fetch_add(&table->codecs[f]->coded_bytes, counts[f].coded);
+    }
+}
+
+typedef struct {
+    const char *mapped;
+    size_t filesize;
+    int nparts;
+    table_t *parts;
+} parse_job_t;
+
+// Start of the first line at or after pos.
+static inline size_t next_line_start(const char *mapped, const size_t filesize, const size_t pos) {
+    if (pos == 0) return 0;
+    const char *newline = memchr(mapped + pos - 1, '\n', filesize - pos + 1);
+    return newline ? (size_t) (newline - mapped) + 1 : filesize;
+}
+
+static void parse_part(void *arg, const int part) {
+    const parse_job_t *job = arg;
+    const size_t begin = next_line_start(job->mapped, job->filesize, job->filesize * part / job->nparts);
+    const size_t end = next_line_start(job->mapped, job->filesize, job->filesize * (part + 1) / job->nparts);
+    parse_lines(job->mapped + begin, job->mapped + end, &job->parts[part]);
+}
+
+// Field f (0-based) of the line [p, end), split like record_split; returns its length or -1.
+static inline long line_field(const char **field, const char *p, const char *end, const int f) {
+    for (int i = 0;; i++) {
+        while (p < end && *p == DELIM) p++;
+        if (p == end) return -1;
+        const char *start = p;
+        while (p < end && *p != DELIM) p++;
+        if (i == f) {
+            *field = start;
+            return p - start;
+        }
+    }
+}
+
+// Gives every column in the mask (bit col, 1-based) a codec trained on the lines of 8
+// evenly spaced 8 KiB windows of the file. With --compress=typed number columns get a
+// number codec and only the others FSST.
+static inline void train_columns(table_t *table, const char *mapped, const size_t filesize,
+                                      const unsigned columns, const char *source) {
+    enum { WINDOWS = 8, WINDOW_SIZE = 8 << 10, CAPACITY = WINDOWS * WINDOW_SIZE };
+    char *text = malloc(CAPACITY);
+    uint16_t *lens = malloc(CAPACITY * sizeof(uint16_t));
+    if (!text || !lens) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int f = 0; f < MAX_FIELDS; f++) {
+        if (!(columns >> (f + 1) & 1)) continue;
+        size_t ntext = 0, nsamples = 0;
+        for (int w = 0; w < WINDOWS; w++) {
+            size_t p = next_line_start(mapped, filesize, filesize * w / WINDOWS);
+            const size_t window_end = p + WINDOW_SIZE < filesize ? p + WINDOW_SIZE : filesize;
+            while (p < window_end) {
+                const char *eol = memchr(mapped + p, '\n', filesize - p);
+                const char *end = eol ? eol : mapped + filesize;
+                const char *line_end = end > mapped + p && end[-1] == '\r' ? end - 1 : end;
+                const char *field;
+                const long len = line_field(&field, mapped + p, line_end, f);
+                if (len > 0 && ntext + len <= CAPACITY) {
+                    memcpy(text + ntext, field, len);
+                    ntext += len;
+                    lens[nsamples++] = (uint16_t) len;
+                }
+                p = end - mapped + 1;
+            }
+        }
+
+        if (nsamples == 0) continue; // no line has this column
+        codec_t *codec = codec_new(source, f + 1);
+        if (!codec) break;
+        if (g_compress != COMPRESS_TYPED || !number_infer(codec, text, lens, nsamples)) {
+            fsst_train(codec, text, lens, nsamples);
+        }
+        table->codecs[f] = codec;
+    }
+    free(text);
+    free(lens);
+}
+
+// Large files are parsed by several workers, each appending to its own segments. Columns
+// in compress_cols (bit col, 1-based) are stored encoded.
+static inline void read_csv_file(const char *filename, table_t *table, const unsigned compress_cols) {
     int fd = open(filename, O_RDONLY);
     if (fd == -1) {
         perror(filename);
         exit(EXIT_FAILURE);
     }
 
-    struct stat sb;
-    if (fstat(fd, &sb) == -1) {
-        perror("fstat");
-        close(fd);
-        exit(EXIT_FAILURE);
+    struct stat sb;
+    if (fstat(fd, &sb) == -1) {
+        perror("fstat");
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+
+    size_t filesize = sb.st_size;
+    if (filesize == 0) {
+        close(fd);
+        return;
+    }
+    char *mapped = mmap(NULL, filesize, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+
+    close(fd); // Close the file descriptor after mapping
+
+    if (compress_cols) train_columns(table, mapped, filesize, compress_cols, filename);
+
+    size_t nparts = filesize / PARSE_CHUNK_MIN;
+    if (nparts > (size_t) g_nthreads) nparts = g_nthreads;
+
+    if (nparts <= 1) {
+        parse_lines(mapped, mapped + filesize, table);
+    } else {
+        table_t parts[nparts];
+        memset(parts, 0, sizeof(parts));
+        table->heap = heap_create();
+        for (size_t p = 0; p < nparts; p++) {
+            parts[p].heap = table->heap;
+            memcpy(parts[p].codecs, table->codecs, sizeof(table->codecs));
+        }
+        parse_job_t job = {.mapped = mapped, .filesize = filesize, .nparts = (int) nparts, .parts = parts};
+        parallel_for((int) nparts, parse_part, &job);
+        table_merge(table, parts, (int) nparts);
+    }
+
+    munmap(mapped, filesize); // Unmap the file
+}
+
+static inline void swap_records(record_t *a, record_t *b) {
+    record_t temp = *a;
+    *a = *b;
+    *b = temp;
+}
+
+// Specialized kernels. Each hot loop is written once as an always-inlined function of the
+// column and instantiated for the columns in KEY_COLUMNS, where the column is a constant:
+// the field offset and the nfields check compile to immediates and strcmp inlines into the
+// loop. A dispatch table picks the instance once per stage; other columns get a generic one.
+#define KEY_COLUMNS(X) X(1) X(2) X(3) X(4)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+// Lomuto partition of rows [low, high) around the last row; returns the pivot's position.
+static ALWAYS_INLINE size_t partition_rows(table_t *table, const size_t low, const size_t high, const int col) {
+    const record_t pivot = *table_row(table, high - 1);
+    const char *pivot_key = record_field(table, &pivot, col);
+    size_t i = low;
+    for (size_t j = low; j < high - 1; j++) {
+        if (strcmp(record_field(table, table_row(table, j), col), pivot_key) <= 0) {
+            swap_records(table_row(table, i), table_row(table, j));
+            i++;
+        }
+    }
+    swap_records(table_row(table, i), table_row(table, high - 1));
+    return i;
+}
+
+// Sorts rows [low, high). Only the smaller partition is sorted recursively, so the stack
+// depth stays logarithmic even for billions of rows.
+#define DEFINE_QUICKSORT(name, COL)                                             \
+    static void name(table_t *table, size_t low, size_t high, const int col) { \
+        (void) col;                                                             \
+        while (high - low > 1) {                                                \
+            const size_t pivot = partition_rows(table, low, high, COL);         \
+            if (pivot - low < high - pivot - 1) {                               \
+                name(table, low, pivot, col);                                   \
+                low = pivot + 1;                                                \
+            } else {                                                            \
+                name(table, pivot + 1, high, col);                              \
+                high = pivot;                                                   \
+            }                                                                   \
+        }                                                                       \
+    }
+
+typedef void (*rows_sort_t)(table_t *table, size_t low, size_t high, int col);
+
+DEFINE_QUICKSORT(quicksort_any, col)
+#define X(COL) DEFINE_QUICKSORT(quicksort_col##COL, COL)
+KEY_COLUMNS(X)
+#undef X
+
+static const rows_sort_t g_quicksorts[] = {
+#define X(COL) [COL] = quicksort_col##COL,
+    KEY_COLUMNS(X)
+#undef X
+};
+
+static inline rows_sort_t quicksort_for(const int col) {
+    const int n = (int) (sizeof(g_quicksorts) / sizeof(g_quicksorts[0]));
+    return col < n && g_quicksorts[col] ? g_quicksorts[col] : quicksort_any;
+}
+
+static inline void sort_rows(table_t *table, const size_t low, const size_t high, const int col) {
+    quicksort_for(col)(table, low, high, col);
+}
+
+typedef struct {
+    table_t *table;
+    int col;
+    size_t bounds[3]; // the two ranges left and right of the pivot
+    int depth;
+} parallel_sort_t;
+
+static void parallel_quicksort(table_t *table, size_t low, size_t high, int col, int depth);
+
+static void parallel_sort_half(void *arg, const int half) {
+    const parallel_sort_t *job = arg;
+    const size_t low = job->bounds[half] + half; // skip the pivot on the right
+    parallel_quicksort(job->table, low, job->bounds[half + 1], job->col, job->depth);
+}
+
+// Partitions like quicksort and sorts both sides in parallel until the ranges are small
+// or there are enough of them for every worker.
+static void parallel_quicksort(table_t *table, const size_t low, const size_t high, const int col, const int depth) {
+    if (depth == 0 || high - low < PARALLEL_MIN_ROWS) {
+        sort_rows(table, low, high, col);
+        return;
+    }
+
+    const size_t i = partition_rows(table, low, high, col);
+    parallel_sort_t job = {.table = table, .col = col, .bounds = {low, i, high}, .depth = depth - 1};
+    parallel_for(2, parallel_sort_half, &job);
+}
+
+// Prefix sort. The sort column is reduced to (first 8 key bytes as a big-endian integer,
+// row) pairs, so comparing two integers orders keys like strcmp does on those bytes. The
+// pairs are sorted by a quicksort whose partitioning and small-range sorting networks use
+// AVX-512 or AVX2 when the cpu has them; ties between keys longer than 8 bytes are then
+// resolved with strcmp and the rows are moved into the sorted order once.
+typedef struct {
+    uint64_t key;
+    uint64_t row;
+} sort_item_t;
+
+typedef struct {
+    const char *name;
+    size_t (*partition)(sort_item_t *items, size_t n, uint64_t bound); // moves keys < bound first
+    void (*small_sort)(sort_item_t *items, size_t n);
+    size_t small;                                                        // largest range for small_sort
+} sort_kernel_t;
+
+typedef enum { SORT_RADIX, SORT_PREFIX, SORT_QUICK } sort_backend_t;
+
+static sort_backend_t g_sort_backend = SORT_RADIX;
+static const sort_kernel_t *g_sort_kernel;
+
+static inline uint64_t key_prefix(const char *key) {
+    uint64_t word = 0;
+    memcpy(&word, key, strnlen(key, sizeof(word)));
+    return __builtin_bswap64(word);
+}
+
+static size_t partition_scalar(sort_item_t *items, const size_t n, const uint64_t bound) {
+    size_t i = 0;
+    for (size_t j = 0; j < n; j++) {
+        if (items[j].key < bound) {
+            const sort_item_t temp = items[i];
+            items[i++] = items[j];
+            items[j] = temp;
+        }
+    }
+    return i;
+}
+
+static void insertion_sort_items(sort_item_t *items, const size_t n) {
+    for (size_t i = 1; i < n; i++) {
+        const sort_item_t item = items[i];
+        size_t j = i;
+        while (j > 0 && items[j - 1].key > item.key) {
+            items[j] = items[j - 1];
+            j--;
+        }
+        items[j] = item;
+    }
+}
+
+// The vector partitions work in place: one vector from each end is held in registers,
+// then the next vector is always read from the side with less free space, so both sides
+// have room for a full vector of output. What is left at the end is placed by scalar code.
+static inline size_t partition_tail(sort_item_t *items, size_t left, size_t right, const size_t read_left,
+                                    const size_t read_right, sort_item_t *saved, const size_t nsaved,
+                                    const uint64_t bound) {
+    sort_item_t rest[nsaved + read_right - read_left];
+    memcpy(rest, saved, nsaved * sizeof(sort_item_t));
+    memcpy(rest + nsaved, items + read_left, (read_right - read_left) * sizeof(sort_item_t));
+    for (size_t i = 0; i < nsaved + read_right - read_left; i++) {
+        if (rest[i].key < bound) items[left++] = rest[i];
+        else items[--right] = rest[i];
+    }
+    return left;
+}
+
+__attribute__((target("avx512f")))
+static size_t partition_avx512(sort_item_t *items, const size_t n, const uint64_t bound) {
+    enum { V = 8 }; // items per step, two registers
+    if (n < 2 * V) return partition_scalar(items, n, bound);
+
+    const __m512i pivot = _mm512_set1_epi64((long long) bound);
+    sort_item_t saved[2 * V];
+    memcpy(saved, items, V * sizeof(sort_item_t));
+    memcpy(saved + V, items + n - V, V * sizeof(sort_item_t));
+
+    size_t read_left = V, read_right = n - V, left = 0, right = n;
+    while (read_right - read_left >= V) {
+        const sort_item_t *block;
+        if (read_left - left <= right - read_right) {
+            block = items + read_left;
+            read_left += V;
+        } else {
+            read_right -= V;
+            block = items + read_right;
+        }
+        const __m512i v[2] = {_mm512_loadu_si512(block), _mm512_loadu_si512(block + 4)};
+        for (int r = 0; r < 2; r++) {
+            // the compare covers key and row lanes; spread each key's bit over its row lane
+            __mmask8 lt = _mm512_cmplt_epu64_mask(v[r], pivot) & 0x55;
+            lt |= lt << 1;
+            const int nleft = __builtin_popcount(lt) / 2;
+            // compressing in registers and storing whole registers into the free space is
+            // faster than compressing stores
+            _mm512_storeu_si512(items + left, _mm512_maskz_compress_epi64(lt, v[r]));
+            _mm512_storeu_si512(items + right - 4, _mm512_maskz_expand_epi64((__mmask8) (0xff << 2 * nleft),
+                                                                        _mm512_maskz_compress_epi64((__mmask8) ~lt, v[r])));
+            left += nleft;
+            right -= 4 - nleft;
+        }
+    }
+    return partition_tail(items, left, right, read_left, read_right, saved, 2 * V, bound);
+}
+
+__attribute__((target("avx2")))
+static size_t partition_avx2(sort_item_t *items, const size_t n, const uint64_t bound) {
+    enum { V = 4 }; // items per step, two registers
+    if (n < 2 * V) return partition_scalar(items, n, bound);
+
+    // AVX2 only compares signed, so both sides are shifted by 2^63
+    const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+    const __m256i pivot = _mm256_xor_si256(_mm256_set1_epi64x((long long) bound), sign);
+    static const int swap_index[2][8] = {{0, 1, 2, 3, 4, 5, 6, 7}, {4, 5, 6, 7, 0, 1, 2, 3}};
+    sort_item_t saved[2 * V];
+    memcpy(saved, items, V * sizeof(sort_item_t));
+    memcpy(saved + V, items + n - V, V * sizeof(sort_item_t));
+
+    size_t read_left = V, read_right = n - V, left = 0, right = n;
+    while (read_right - read_left >= V) {
+        const sort_item_t *block;
+        if (read_left - left <= right - read_right) {
+            block = items + read_left;
+            read_left += V;
+        } else {
+            read_right -= V;
+            block = items + read_right;
+        }
+        const __m256i v[2] = {_mm256_loadu_si256((const __m256i *) block),
+                              _mm256_loadu_si256((const __m256i *) (block + 2))};
+        for (int r = 0; r < 2; r++) {
+            const __m256i lt = _mm256_cmpgt_epi64(pivot, _mm256_xor_si256(v[r], sign));
+            const int mask = _mm256_movemask_pd(_mm256_castsi256_pd(lt));
+            // with two items per register only "second item alone on the left" needs a
+            // swap; the register goes to both sides and the surplus lands in free space
+            const __m256i order = _mm256_loadu_si256((const __m256i *) swap_index[(mask & 5) == 4]);
+            const __m256i sorted = _mm256_permutevar8x32_epi32(v[r], order);
+            const int nleft = (mask & 1) + ((mask >> 2) & 1);
+            _mm256_storeu_si256((__m256i *) (items + left), sorted);
+            _mm256_storeu_si256((__m256i *) (items + right - 2), sorted);
+            left += nleft;
+            right -= 2 - nleft;
+        }
+    }
+    return partition_tail(items, left, right, read_left, read_right, saved, 2 * V, bound);
+}
+
+// Bitonic sorting network over 16 items held as keys and rows in two registers each. A
+// step compares every lane with a partner lane of the same register; the masks name the
+// lanes that keep the smaller key, for the lower and the upper register. Ranges shorter
+// than 16 are padded with UINT64_MAX keys, so they must not contain that key.
+__attribute__((target("avx512f"), always_inline))
+static inline void bitonic_step_avx512(__m512i keys[2], __m512i rows[2], const __m512i partner,
+                                       const __mmask8 min_lower, const __mmask8 min_upper) {
+    for (int r = 0; r < 2; r++) {
+        const __mmask8 want_min = r ? min_upper : min_lower;
+        const __m512i other = _mm512_permutexvar_epi64(partner, keys[r]);
+        const __mmask8 take = (_mm512_cmplt_epu64_mask(other, keys[r]) & want_min) |
+                              (_mm512_cmpgt_epu64_mask(other, keys[r]) & (__mmask8) ~want_min);
+        keys[r] = _mm512_mask_mov_epi64(keys[r], take, other);
+        rows[r] = _mm512_mask_mov_epi64(rows[r], take, _mm512_permutexvar_epi64(partner, rows[r]));
+    }
+}
+
+__attribute__((target("avx512f")))
+static void small_sort_avx512(sort_item_t *items, const size_t n) {
+    sort_item_t buf[16];
+    for (size_t i = 0; i < n; i++) {
+        if (items[i].key == UINT64_MAX) {
+            insertion_sort_items(items, n);
+            return;
+        }
+    }
+    memcpy(buf, items, n * sizeof(sort_item_t));
+    memset(buf + n, 0xff, (16 - n) * sizeof(sort_item_t));
+
+    const __m512i even = _mm512_setr_epi64(0, 2, 4, 6, 8, 10, 12, 14);
+    const __m512i odd = _mm512_setr_epi64(1, 3, 5, 7, 9, 11, 13, 15);
+    __m512i v[4];
+    for (int r = 0; r < 4; r++) v[r] = _mm512_loadu_si512(buf + 4 * r);
+    __m512i keys[2] = {_mm512_permutex2var_epi64(v[0], even, v[1]), _mm512_permutex2var_epi64(v[2], even, v[3])};
+    __m512i rows[2] = {_mm512_permutex2var_epi64(v[0], odd, v[1]), _mm512_permutex2var_epi64(v[2], odd, v[3])};
+
+    const __m512i swap1 = _mm512_setr_epi64(1, 0, 3, 2, 5, 4, 7, 6);
+    const __m512i swap2 = _mm512_setr_epi64(2, 3, 0, 1, 6, 7, 4, 5);
+    const __m512i swap4 = _mm512_setr_epi64(4, 5, 6, 7, 0, 1, 2, 3);
+    bitonic_step_avx512(keys, rows, swap1, 0x99, 0x99); // sorted pairs
+    bitonic_step_avx512(keys, rows, swap2, 0xc3, 0xc3);
+    bitonic_step_avx512(keys, rows, swap1, 0xa5, 0xa5); // sorted fours
+    bitonic_step_avx512(keys, rows, swap4, 0x0f, 0xf0);
+    bitonic_step_avx512(keys, rows, swap2, 0x33, 0xcc);
+    bitonic_step_avx512(keys, rows, swap1, 0x55, 0xaa); // lower ascending, upper descending
+    const __mmask8 swap = _mm512_cmpgt_epu64_mask(keys[0], keys[1]);
+    const __m512i lower_keys = keys[0], lower_rows = rows[0];
+    keys[0] = _mm512_mask_mov_epi64(keys[0], swap, keys[1]);
+    rows[0] = _mm512_mask_mov_epi64(rows[0], swap, rows[1]);
+    keys[1] = _mm512_mask_mov_epi64(keys[1], swap, lower_keys);
+    rows[1] = _mm512_mask_mov_epi64(rows[1], swap, lower_rows);
+    bitonic_step_avx512(keys, rows, swap4, 0x0f, 0x0f);
+    bitonic_step_avx512(keys, rows, swap2, 0x33, 0x33);
+    bitonic_step_avx512(keys, rows, swap1, 0x55, 0x55);
+
+    const __m512i low = _mm512_setr_epi64(0, 8, 1, 9, 2, 10, 3, 11);
+    const __m512i high = _mm512_setr_epi64(4, 12, 5, 13, 6, 14, 7, 15);
+    for (int r = 0; r < 2; r++) {
+        _mm512_storeu_si512(buf + 8 * r, _mm512_permutex2var_epi64(keys[r], low, rows[r]));
+        _mm512_storeu_si512(buf + 8 * r + 4, _mm512_permutex2var_epi64(keys[r], high, rows[r]));
+    }
+    memcpy(items, buf, n * sizeof(sort_item_t));
+}
+
+// Same network over 8 items in 4-lane registers. AVX2 has no mask registers, so the lane
+// masks are expanded to vectors, and keys are compared with the sign bit flipped.
+__attribute__((target("avx2"), always_inline))
+static inline __m256i lane_mask_avx2(const int bits) {
+    const __m256i lanes = _mm256_setr_epi64x(1, 2, 4, 8);
+    return _mm256_cmpeq_epi64(_mm256_and_si256(_mm256_set1_epi64x(bits), lanes), lanes);
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline void bitonic_step_avx2(__m256i keys[2], __m256i rows[2], const __m256i partner,
+                                     const int min_lower, const int min_upper) {
+    const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+    for (int r = 0; r < 2; r++) {
+        const __m256i want_min = lane_mask_avx2(r ? min_upper : min_lower);
+        const __m256i other = _mm256_permutevar8x32_epi32(keys[r], partner);
+        const __m256i self_s = _mm256_xor_si256(keys[r], sign), other_s = _mm256_xor_si256(other, sign);
+        const __m256i take = _mm256_or_si256(_mm256_and_si256(_mm256_cmpgt_epi64(self_s, other_s), want_min),
+                                             _mm256_andnot_si256(want_min, _mm256_cmpgt_epi64(other_s, self_s)));
+        keys[r] = _mm256_blendv_epi8(keys[r], other, take);
+        rows[r] = _mm256_blendv_epi8(rows[r], _mm256_permutevar8x32_epi32(rows[r], partner), take);
+    }
+}
+
+__attribute__((target("avx2")))
+static void small_sort_avx2(sort_item_t *items, const size_t n) {
+    sort_item_t buf[8];
+    for (size_t i = 0; i < n; i++) {
+        if (items[i].key == UINT64_MAX) {
+            insertion_sort_items(items, n);
+            return;
+        }
+    }
+    memcpy(buf, items, n * sizeof(sort_item_t));
+    memset(buf + n, 0xff, (8 - n) * sizeof(sort_item_t));
+
+    __m256i keys[2], rows[2];
+    for (int r = 0; r < 2; r++) {
+        const __m256i a = _mm256_loadu_si256((const __m256i *) (buf + 4 * r));
+        const __m256i b = _mm256_loadu_si256((const __m256i *) (buf + 4 * r + 2));
+        keys[r] = _mm256_permute4x64_epi64(_mm256_unpacklo_epi64(a, b), 0xd8);
+        rows[r] = _mm256_permute4x64_epi64(_mm256_unpackhi_epi64(a, b), 0xd8);
+    }
+
+    const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+    const __m256i swap1 = _mm256_setr_epi32(2, 3, 0, 1, 6, 7, 4, 5);
+    const __m256i swap2 = _mm256_setr_epi32(4, 5, 6, 7, 0, 1, 2, 3);
+    bitonic_step_avx2(keys, rows, swap1, 0x9, 0x9);
+    bitonic_step_avx2(keys, rows, swap2, 0x3, 0xc);
+    bitonic_step_avx2(keys, rows, swap1, 0x5, 0xa);
+    const __m256i swap = _mm256_cmpgt_epi64(_mm256_xor_si256(keys[0], sign), _mm256_xor_si256(keys[1], sign));
+    const __m256i lower_keys = keys[0], lower_rows = rows[0];
+    keys[0] = _mm256_blendv_epi8(keys[0], keys[1], swap);
+    rows[0] = _mm256_blendv_epi8(rows[0], rows[1], swap);
+    keys[1] = _mm256_blendv_epi8(keys[1], lower_keys, swap);
+    rows[1] = _mm256_blendv_epi8(rows[1], lower_rows, swap);
+    bitonic_step_avx2(keys, rows, swap2, 0x3, 0x3);
+    bitonic_step_avx2(keys, rows, swap1, 0x5, 0x5);
+
+    for (int r = 0; r < 2; r++) {
+        const __m256i k = _mm256_permute4x64_epi64(keys[r], 0xd8), v = _mm256_permute4x64_epi64(rows[r], 0xd8);
+        _mm256_storeu_si256((__m256i *) (buf + 4 * r), _mm256_unpacklo_epi64(k, v));
+        _mm256_storeu_si256((__m256i *) (buf + 4 * r + 2), _mm256_unpackhi_epi64(k, v));
+    }
+    memcpy(items, buf, n * sizeof(sort_item_t));
+}
+
+static const sort_kernel_t g_sort_kernels[NISAS] = {
+    [ISA_SCALAR] = {"scalar", partition_scalar, insertion_sort_items, 16},
+    [ISA_AVX2] = {"avx2", partition_avx2, small_sort_avx2, 8},
+    [ISA_AVX512] = {"avx512", partition_avx512, small_sort_avx512, 16},
+};
+
+// Selects every kernel for the best instruction set the cpu supports, or for forced if
+// that is not NISAS.
+static inline void kernels_init(const isa_t forced) {
+    if (forced != NISAS) {
+        if (!isa_supported(forced)) {
+            fprintf(stderr, "The cpu does not support %s!\n", g_isa_names[forced]);
+            exit(EXIT_FAILURE);
+        }
+        g_isa = forced;
+    } else {
+        g_isa = ISA_SCALAR;
+        while (g_isa + 1 < NISAS && isa_supported(g_isa + 1)) g_isa++;
+    }
+    crc32c_init();
+    g_scan_kernel = ISA_SELECT(g_scan_kernels);
+    g_sort_kernel = ISA_SELECT(g_sort_kernels);
+    g_hash_kernel = ISA_SELECT(g_hash_kernels);
+}
+
+static atomic_size_t g_hashed_rows;
+
+static inline void print_kernel_stats(void) {
+    fprintf(stderr, "isa %s: scan %s, sort %s, hash %s (%zu keys hashed)\n", g_isa_names[g_isa], g_scan_kernel->name,
+            g_sort_kernel->name, g_hash_kernel->name, atomic_load(&g_hashed_rows));
+}
+
+static inline uint64_t median_of_three(const uint64_t a, const uint64_t b, const uint64_t c) {
+    if (a < b) return b < c ? b : (a < c ? c : a);
+    return a < c ? a : (b < c ? c : b);
+}
+
+// Splits items around a pivot key and returns the size of the lower part; when the pivot
+// is the smallest key, the run of keys equal to it is split off instead, so many equal
+// keys cannot make the sort quadratic. The returned part is done when *equal is set.
+static inline size_t items_split(const sort_kernel_t *kernel, sort_item_t *items, const size_t n, int *equal) {
+    const uint64_t pivot = median_of_three(items[0].key, items[n / 2].key, items[n - 1].key);
+    const size_t lower = kernel->partition(items, n, pivot);
+    *equal = lower == 0;
+    if (!*equal) return lower;
+    return pivot == UINT64_MAX ? n : kernel->partition(items, n, pivot + 1);
+}
+
+static void items_quicksort(const sort_kernel_t *kernel, sort_item_t *items, size_t n) {
+    while (n > kernel->small) {
+        int equal;
+        const size_t lower = items_split(kernel, items, n, &equal);
+        if (equal) {
+            items += lower;
+            n -= lower;
+        } else if (lower < n - lower) {
+            items_quicksort(kernel, items, lower);
+            items += lower;
+            n -= lower;
+        } else {
+            items_quicksort(kernel, items + lower, n - lower);
+            n = lower;
+        }
+    }
+    kernel->small_sort(items, n);
+}
+
+typedef struct {
+    sort_item_t *items;
+    size_t bounds[3];
+    int equal; // the lower part holds only equal keys
+    int depth;
+} parallel_items_t;
+
+static void parallel_items_sort(sort_item_t *items, size_t n, int depth);
+
+static void parallel_items_half(void *arg, const int half) {
+    const parallel_items_t *job = arg;
+    if (half == 0 && job->equal) return;
+    parallel_items_sort(job->items + job->bounds[half], job->bounds[half + 1] - job->bounds[half], job->depth);
+}
+
+static void parallel_items_sort(sort_item_t *items, const size_t n, const int depth) {
+    if (depth == 0 || n < PARALLEL_MIN_ROWS) {
+        items_quicksort(g_sort_kernel, items, n);
+        return;
+    }
+    parallel_items_t job = {.items = items, .depth = depth - 1};
+    const size_t lower = items_split(g_sort_kernel, items, n, &job.equal);
+    job.bounds[1] = lower;
+    job.bounds[2] = n;
+    parallel_for(2, parallel_items_half, &job);
+}
+
+// In-place MSD radix sort of the pairs, one key byte per level (American flag sort):
+// count the bytes, then swap every item into its bucket along permutation cycles, so no
+// second array is needed. Buckets are sorted on the next byte, small ones and those
+// reached after the 8th byte by the comparison kernels above.
+#define RADIX_MIN_ITEMS 2048
+
+typedef struct {
+    size_t head[256]; // next unplaced slot of each bucket
+    size_t tail[256]; // end of each bucket
+} radix_buckets_t;
+
+static inline int key_byte(const uint64_t key, const int level) {
+    return (int) (key >> (56 - 8 * level)) & 0xff;
+}
+
+// Places the items between head and tail of every bucket. Each pass swaps every unplaced
+// item to the head of its bucket without waiting for the item it gets back, which keeps
+// the swaps independent; what a pass swapped into a bucket is checked by the next one.
+static inline void radix_permute(sort_item_t *items, radix_buckets_t *buckets, const int level) {
+    int remaining[256], nremaining = 0;
+    for (int b = 0; b < 256; b++) {
+        if (buckets->head[b] < buckets->tail[b]) remaining[nremaining++] = b;
+    }
+    while (nremaining > 0) {
+        int kept = 0;
+        for (int r = 0; r < nremaining; r++) {
+            const int b = remaining[r];
+            const size_t end = buckets->tail[b];
+            for (size_t i = buckets->head[b]; i < end; i++) {
+                const size_t to = buckets->head[key_byte(items[i].key, level)]++;
+                const sort_item_t temp = items[i];
+                items[i] = items[to];
+                items[to] = temp;
+            }
+            if (buckets->head[b] < end) remaining[kept++] = b;
+        }
+        nremaining = kept;
+    }
+}
+
+static void radix_sort_items(sort_item_t *items, const size_t n, int level) {
+    size_t count[256];
+    for (;;) {
+        if (n <= RADIX_MIN_ITEMS || level == 8) {
+            items_quicksort(g_sort_kernel, items, n);
+            return;
+        }
+        memset(count, 0, sizeof(count));
+        for (size_t i = 0; i < n; i++) count[key_byte(items[i].key, level)]++;
+        if (count[key_byte(items[0].key, level)] < n) break;
+        level++; // every key has the same byte here
+    }
+
+    radix_buckets_t buckets;
+    size_t start = 0;
+    for (int b = 0; b < 256; b++) {
+        buckets.head[b] = start;
+        start += count[b];
+        buckets.tail[b] = start;
+    }
+    radix_permute(items, &buckets, level);
+    for (int b = 0; b < 256; b++) {
+        radix_sort_items(items + buckets.tail[b] - count[b], count[b], level + 1);
+    }
+}
+
+// Parallel version of one level (PARADIS): every thread gets a stripe of every bucket and
+// permutes within its own stripes. Items that do not fit there stay behind; a repair step
+// per bucket moves them to the end of the bucket for the next round, until few are left
+// for radix_permute. Then the buckets are sorted in parallel.
+typedef struct {
+    sort_item_t *items;
+    size_t n;
+    int level;
+    int depth;
+    int nparts;
+    size_t (*counts)[256];          // per part
+    radix_buckets_t buckets;
+    radix_buckets_t *stripes;       // per part
+} radix_job_t;
+
+static void parallel_radix_sort(sort_item_t *items, size_t n, int level, int depth);
+
+static void radix_count_part(void *arg, const int part) {
+    const radix_job_t *job = arg;
+    size_t *count = job->counts[part];
+    memset(count, 0, 256 * sizeof(size_t));
+    for (size_t i = job->n * part / job->nparts; i < job->n * (part + 1) / job->nparts; i++) {
+        count[key_byte(job->items[i].key, job->level)]++;
+    }
+}
+
+static void radix_permute_part(void *arg, const int part) {
+    const radix_job_t *job = arg;
+    sort_item_t *items = job->items;
+    radix_buckets_t *stripe = &job->stripes[part];
+    for (int b = 0; b < 256; b++) {
+        while (stripe->head[b] < stripe->tail[b]) {
+            sort_item_t item = items[stripe->head[b]];
+            int k = key_byte(item.key, job->level);
+            while (k != b && stripe->head[k] < stripe->tail[k]) {
+                const sort_item_t next = items[stripe->head[k]];
+                items[stripe->head[k]++] = item;
+                item = next;
+                k = key_byte(item.key, job->level);
+            }
+            items[stripe->head[b]] = item;
+            if (k != b) break; // no room left in the stripe of k
+            stripe->head[b]++;
+        }
+    }
+}
+
+// Swaps the misplaced items in the unprocessed stripe ranges of bucket b with items of b
+// taken from the end, so that the bucket is done up to its new head.
+static void radix_repair_bucket(void *arg, const int b) {
+    radix_job_t *job = arg;
+    sort_item_t *items = job->items;
+    size_t end = job->buckets.tail[b];
+    for (int p = 0; p < job->nparts; p++) {
+        for (size_t h = job->stripes[p].head[b]; h < job->stripes[p].tail[b] && h < end; h++) {
+            if (key_byte(items[h].key, job->level) == b) continue;
+            while (--end > h && key_byte(items[end].key, job->level) != b) {}
+            if (end == h) break;
+            const sort_item_t temp = items[h];
+            items[h] = items[end];
+            items[end] = temp;
+        }
+    }
+    job->buckets.head[b] = end;
+}
+
+static void radix_sort_bucket(void *arg, const int b) {
+    const radix_job_t *job = arg;
+    const size_t begin = b ? job->buckets.tail[b - 1] : 0, n = job->buckets.tail[b] - begin;
+    if (job->depth > 0 && n >= PARALLEL_MIN_ROWS) parallel_radix_sort(job->items + begin, n, job->level + 1, job->depth - 1);
+    else radix_sort_items(job->items + begin, n, job->level + 1);
+}
+
+static void parallel_radix_sort(sort_item_t *items, const size_t n, int level, const int depth) {
+    if (n < PARALLEL_MIN_ROWS || level == 8) {
+        radix_sort_items(items, n, level);
+        return;
+    }
+    radix_job_t job = {.items = items, .n = n, .depth = depth, .nparts = g_nthreads};
+    job.counts = malloc(job.nparts * sizeof(*job.counts));
+    job.stripes = malloc(job.nparts * sizeof(*job.stripes));
+    if (!job.counts || !job.stripes) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t count[256];
+    for (;; level++) {
+        job.level = level;
+        parallel_for(job.nparts, radix_count_part, &job);
+        memset(count, 0, sizeof(count));
+        for (int p = 0; p < job.nparts; p++) {
+            for (int b = 0; b < 256; b++) count[b] += job.counts[p][b];
+        }
+        if (count[key_byte(items[0].key, level)] < n || level == 7) break;
+    }
+
+    size_t start = 0;
+    for (int b = 0; b < 256; b++) {
+        job.buckets.head[b] = start;
+        start += count[b];
+        job.buckets.tail[b] = start;
+    }
+    size_t remaining = n;
+    while (remaining >= PARALLEL_MIN_ROWS) {
+        for (int b = 0; b < 256; b++) {
+            const size_t left = job.buckets.tail[b] - job.buckets.head[b];
+            for (int p = 0; p < job.nparts; p++) {
+                job.stripes[p].head[b] = job.buckets.head[b] + left * p / job.nparts;
+                job.stripes[p].tail[b] = job.buckets.head[b] + left * (p + 1) / job.nparts;
+            }
+        }
+        parallel_for(job.nparts, radix_permute_part, &job);
+        parallel_for(256, radix_repair_bucket, &job);
+
+        size_t left = 0;
+        for (int b = 0; b < 256; b++) left += job.buckets.tail[b] - job.buckets.head[b];
+        if (left > remaining / 2) break; // the rounds stopped paying off
+        remaining = left;
+    }
+    radix_permute(items, &job.buckets, level);
+
+    parallel_for(256, radix_sort_bucket, &job);
+    free(job.counts);
+    free(job.stripes);
+}
+
+static ALWAYS_INLINE int item_compare(const void *a, const void *b, const table_t *table, const int col) {
+    return strcmp(record_field(table, table_row(table, ((const sort_item_t *) a)->row), col),
+                  record_field(table, table_row(table, ((const sort_item_t *) b)->row), col));
+}
+
+typedef int (*items_compare_t)(const void *a, const void *b, void *table);
+
+#define DEFINE_ITEM_COMPARE(COL)                                                                \
+    static int item_compare_col##COL(const void *a, const void *b, void *table) {               \
+        return item_compare(a, b, table, COL);                                                  \
+    }
+KEY_COLUMNS(DEFINE_ITEM_COMPARE)
+#undef DEFINE_ITEM_COMPARE
+
+static const items_compare_t g_item_compares[] = {
+#define X(COL) [COL] = item_compare_col##COL,
+    KEY_COLUMNS(X)
+#undef X
+};
+
+typedef struct {
+    table_t *table;
+    sort_item_t *items;
+    segment_t **segments; // the sorted copy
+    size_t *bounds;       // nparts + 1 row boundaries of the placement parts
+    int col;
+    int nparts;
+} prefix_sort_job_t;
+
+// Keys of columns without a specialized comparison are compared through the job.
+static int item_compare_any(const void *a, const void *b, void *arg) {
+    const prefix_sort_job_t *job = arg;
+    return item_compare(a, b, job->table, job->col);
+}
+
+static void prefix_fill_part(void *arg, const int part) {
+    const prefix_sort_job_t *job = arg;
+    const table_t *table = job->table;
+    const int col = job->col;
+    const size_t begin = table->count * part / job->nparts, end = table->count * (part + 1) / job->nparts;
+    for (size_t i = begin; i < end; i++) {
+        job->items[i].key = key_prefix(record_field(table, table_row(table, i), col));
+        job->items[i].row = i;
+    }
+}
+
+// Only keys that fill all 8 prefix bytes can differ after them; runs of those are sorted
+// by the whole key. Then every row of the part is copied to its sorted position.
+static void prefix_place_part(void *arg, const int part) {
+    const prefix_sort_job_t *job = arg;
+    sort_item_t *items = job->items;
+    const size_t begin = job->bounds[part], end = job->bounds[part + 1];
+
+    const int n = (int) (sizeof(g_item_compares) / sizeof(g_item_compares[0]));
+    items_compare_t compare = job->col < n ? g_item_compares[job->col] : NULL;
+    void *context = job->table;
+    if (!compare) {
+        compare = item_compare_any;
+        context = (void *) job;
+    }
+    for (size_t i = begin; i < end;) {
+        size_t run = i + 1;
+        while (run < end && items[run].key == items[i].key) run++;
+        if (run - i > 1 && (items[i].key & 0xff)) qsort_r(items + i, run - i, sizeof(sort_item_t), compare, context);
+        i = run;
+    }
+    for (size_t i = begin; i < end; i++) {
+        job->segments[i >> SEGMENT_SHIFT]->rows[i & SEGMENT_MASK] = *table_row(job->table, items[i].row);
+    }
+}
+
+// Moves the part boundaries past runs that may need the whole key, so no run is split.
+static inline void prefix_place_bounds(prefix_sort_job_t *job) {
+    const sort_item_t *items = job->items;
+    const size_t count = job->table->count;
+    job->bounds[0] = 0;
+    for (int p = 1; p <= job->nparts; p++) {
+        size_t b = count * p / job->nparts;
+        if (b < job->bounds[p - 1]) b = job->bounds[p - 1];
+        while (b > 0 && b < count && (items[b].key & 0xff) && items[b].key == items[b - 1].key) b++;
+        job->bounds[p] = b;
+    }
+}
+
+static atomic_size_t g_key_raw_bytes;
+static atomic_size_t g_key_coded_bytes;
+static int g_front_keys;
+
+typedef struct {
+    const table_t *table;
+    const sort_item_t *items; // the sorted (key prefix, row) pairs of the rows, or NULL
+    int col;
+    int nparts;
+    size_t *restarts;
+    uint8_t **data; // per part
+    size_t *sizes;
+    size_t *raw;
+    atomic_int too_long;
+} key_build_job_t;
+
+// Front codes the keys of the part-th range of blocks into a buffer of its own.
+static void key_build_part(void *arg, const int part) {
+    key_build_job_t *job = arg;
+    const table_t *table = job->table;
+    const size_t nblocks = (table->count + KEY_BLOCK - 1) / KEY_BLOCK;
+    const size_t begin = nblocks * part / job->nparts * KEY_BLOCK;
+    size_t end = nblocks * (part + 1) / job->nparts * KEY_BLOCK;
+    if (end > table->count) end = table->count;
+
+    size_t capacity = (end - begin) * 8 + 64, size = 0, raw = 0;
+    uint8_t *data = malloc(capacity);
+    const char *prev = "";
+    size_t prev_len = 0;
+    char short_keys[2][8];
+    for (size_t i = begin; data && i < end; i++) {
+        // A key shorter than 8 bytes is all in its sort prefix, which saves reading the row
+        const char *key;
+        size_t len;
+        if (job->items && !(job->items[i].key & 0xff)) {
+            const uint64_t word = __builtin_bswap64(job->items[i].key);
+            memcpy(short_keys[i & 1], &word, sizeof(word));
+            key = short_keys[i & 1];
+            len = strnlen(key, sizeof(word));
+        } else {
+            key = record_field(table, table_row(table, i), job->col);
+            len = strlen(key);
+        }
+        if (len >= 0x8000) {
+            atomic_store(&job->too_long, 1);
+            break;
+        }
+        size_t prefix = 0;
+        if (i % KEY_BLOCK == 0) {
+            job->restarts[i / KEY_BLOCK] = size; // relative to the part until the parts are joined
+        } else {
+            while (prefix < len && prefix < prev_len && key[prefix] == prev[prefix]) prefix++;
+        }
+        if (size + len + 4 > capacity) {
+            capacity = 2 * capacity + len;
+            uint8_t *grown = realloc(data, capacity);
+            if (!grown) free(data);
+            data = grown;
+            if (!data) break;
+        }
+        size += put_len(data + size, prefix);
+        size += put_len(data + size, len - prefix);
+        memcpy(data + size, key + prefix, len - prefix);
+        size += len - prefix;
+        raw += len + 1;
+        prev = key;
+        prev_len = len;
+    }
+    if (!data) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+    job->data[part] = data;
+    job->sizes[part] = size;
+    job->raw[part] = raw;
+}
+
+// Builds the front-coded key column of a table sorted on col, taking short keys from the
+// sort pairs if there are any. Tables with keys too long for the length encoding keep
+// reading their keys from the rows.
+static inline void key_column_build(table_t *table, const int col, const sort_item_t *items) {
+    key_column_t *keys = &table->keys;
+    key_column_free(keys);
+    if (!g_front_keys || table->count == 0) return;
+
+    const size_t nblocks = (table->count + KEY_BLOCK - 1) / KEY_BLOCK;
+    const int parallel = g_nthreads > 1 && tl_sched && table->count >= PARALLEL_MIN_ROWS;
+    const int nparts = parallel ? 4 * g_nthreads : 1;
+    uint8_t *data[nparts];
+    size_t sizes[nparts], raw[nparts];
+    key_build_job_t job = {.table = table, .items = items, .col = col, .nparts = nparts,
+                           .restarts = malloc(nblocks * sizeof(size_t)), .data = data, .sizes = sizes, .raw = raw};
+    if (!job.restarts) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+    if (parallel) parallel_for(nparts, key_build_part, &job);
+    else key_build_part(&job, 0);
+
+    size_t size = 0, raw_bytes = 0;
+    for (int p = 0; p < nparts; p++) {
+        size += sizes[p];
+        raw_bytes += raw[p];
+    }
+    keys->data = atomic_load(&job.too_long) ? NULL : malloc(size ? size : 1);
+    size_t pos = 0;
+    for (int p = 0; p < nparts; p++) {
+        if (keys->data) {
+            for (size_t b = nblocks * p / nparts; b < nblocks * (p + 1) / nparts; b++) job.restarts[b] += pos;
+            memcpy(keys->data + pos, data[p], sizes[p]);
+        }
+        pos += sizes[p];
+        free(data[p]);
+    }
+    if (!keys->data) {
+        free(job.restarts);
+        return;
+    }
+    keys->restarts = job.restarts;
+    keys->size = size;
+    keys->col = col;
+    atomic_fetch_add(&g_key_raw_bytes, raw_bytes);
+    atomic_fetch_add(&g_key_coded_bytes, size + nblocks * sizeof(size_t));
+}
+
+static inline void print_key_stats(void) {
+    const size_t raw = atomic_load(&g_key_raw_bytes), coded = atomic_load(&g_key_coded_bytes);
+    if (raw) fprintf(stderr, "front-coded keys: %zu -> %zu bytes (%.2fx)\n", raw, coded, (double) raw / coded);
+}
+
+typedef struct {
+    table_t *table;
+    int col;
+    int nparts;
+} hash_build_job_t;
+
+static void hash_build_part(void *arg, const int part) {
+    const hash_build_job_t *job = arg;
+    const size_t count = job->table->count;
+    const size_t begin = count * part / job->nparts, end = count * (part + 1) / job->nparts;
+    g_hash_kernel->hash_rows(job->table, job->col, begin, end, job->table->hashes.values + begin);
+}
+
+// Hashes every key of column col once, for all hash-based stages reading the table. The
+// hashes follow the row order, so they are dropped whenever the rows move.
+static inline void hash_column_build(table_t *table, const int col) {
+    hash_column_t *hashes = &table->hashes;
+    if (hashes->col == col) return;
+    hash_column_free(hashes);
+    if (table->count == 0) return;
+
+    hashes->values = table_alloc(table->count * sizeof(uint32_t));
+    if (!hashes->values) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+    hashes->count = table->count;
+    const int parallel = g_nthreads > 1 && tl_sched && table->count >= PARALLEL_MIN_ROWS;
+    hash_build_job_t job = {.table = table, .col = col, .nparts = parallel ? 4 * g_nthreads : 1};
+    if (parallel) parallel_for(job.nparts, hash_build_part, &job);
+    else hash_build_part(&job, 0);
+    hashes->col = col;
+    atomic_fetch_add(&g_hashed_rows, table->count);
+}
+
+// Workers insert concurrently: a row takes the first empty slot from its hash on, claimed
+// with a CAS; a lost race moves on to the next slot.
+static void index_build_part(void *arg, const int part) {
+    const hash_build_job_t *job = arg;
+    hash_index_t *index = &job->table->index;
+    const uint32_t *hashes = job->table->hashes.values;
+    const size_t count = job->table->count;
+    const size_t begin = count * part / job->nparts, end = count * (part + 1) / job->nparts;
+    for (size_t i = begin; i < end; i++) {
+        const uint64_t entry = (uint64_t) hashes[i] << 32 | (i + 1);
+        for (size_t s = hashes[i] & index->mask;; s = (s + 1) & index->mask) {
+            uint64_t empty = 0;
+            if (atomic_load_explicit(&index->slots[s], memory_order_relaxed) == 0 &&
+                atomic_compare_exchange_strong_explicit(&index->slots[s], &empty, entry,
+                                                        memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        }
+    }
+}
+
+// Builds the hash index of column col with at least two slots per row, from the hash column.
+static inline void hash_index_build(table_t *table, const int col) {
+    hash_index_t *index = &table->index;
+    if (index->col == col) return;
+    hash_index_free(index);
+    if (table->count >= UINT32_MAX) {
+        fprintf(stderr, "Table too large for a hash index!\n");
+        exit(EXIT_FAILURE);
+    }
+    hash_column_build(table, col);
+
+    size_t capacity = 16;
+    while (capacity < 2 * table->count) capacity *= 2;
+    index->slots = table_alloc(capacity * sizeof(uint64_t));
+    if (!index->slots) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+    index->mask = capacity - 1;
+    const int parallel = g_nthreads > 1 && tl_sched && table->count >= PARALLEL_MIN_ROWS;
+    hash_build_job_t job = {.table = table, .col = col, .nparts = parallel ? 4 * g_nthreads : 1};
+    if (parallel) parallel_for(job.nparts, index_build_part, &job);
+    else index_build_part(&job, 0);
+    index->col = col;
+}
+
+// 64-bit key hash for the perfect hash: 32-bit hashes would already collide a few hundred
+// times among a few million keys, and every collision costs a fallback entry.
+static inline uint64_t mix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    return h ^ h >> 33;
+}
+
+static inline uint64_t key_hash64(const char *key, const size_t len) {
+    uint64_t h = len * 0x9e3779b97f4a7c15ULL, word;
+    size_t i = 0;
+    for (; i + sizeof(word) <= len; i += sizeof(word)) {
+        memcpy(&word, key + i, sizeof(word));
+        h = (h ^ word) * 0xbf58476d1ce4e5b9ULL;
+        h ^= h >> 31;
+    }
+    word = 0;
+    memcpy(&word, key + i, len - i);
+    return mix64(h ^ word);
+}
+
+// Bit of a key on a level with nbits bits, from a multiply instead of a division.
+static inline size_t mph_position(const uint64_t hash, const int level, const size_t nbits) {
+    const uint64_t h = mix64(hash ^ (0x9e3779b97f4a7c15ULL * (uint64_t) (level + 1)));
+    return (size_t) (((unsigned __int128) h * nbits) >> 64);
+}
+
+static inline void mph_rank_init(mph_t *mph) {
+    const size_t words = mph->levels[mph->nlevels];
+    mph->ranks = malloc((words ? words : 1) * sizeof(uint32_t));
+    if (!mph->ranks) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+    uint32_t rank = 0;
+    for (size_t w = 0; w < words; w++) {
+        mph->ranks[w] = rank;
+        rank += __builtin_popcountll(mph->bits[w]);
+    }
+    mph->nbits_set = rank;
+}
+
+// Number in [0, nkeys) of a key of the set, SIZE_MAX for most other keys. A key not in the
+// set can still get a number, so callers compare it with a key having that number.
+static inline size_t mph_lookup(const mph_t *mph, const uint64_t hash, const char *key) {
+    for (int l = 0; l < mph->nlevels; l++) {
+        const size_t nbits = (mph->levels[l + 1] - mph->levels[l]) * 64;
+        const size_t bit = mph->levels[l] * 64 + mph_position(hash, l, nbits);
+        const size_t w = bit / 64;
+        const uint64_t below = mph->bits[w] & ((1ULL << (bit % 64)) - 1);
+        if (!(mph->bits[w] >> (bit % 64) & 1)) continue;
+        return mph->ranks[w] + __builtin_popcountll(below);
+    }
+    for (size_t j = 0; j < mph->nfallback; j++) {
+        if (mph->fallback_hashes[j] == hash && strcmp(mph->fallback_keys[j], key) == 0) return mph->nbits_set + j;
+    }
+    return SIZE_MAX;
+}
+
+// Builds the perfect hash of n distinct keys given as (hash, row of the key) pairs; the
+// pairs are reordered. Every level has two bits per remaining key.
+static inline void mph_build(mph_t *mph, sort_item_t *keys, size_t n, const table_t *table, const int col) {
+    *mph = (mph_t) {.nkeys = n};
+    size_t words = 0;
+    uint64_t *bits = NULL;
+    while (n && mph->nlevels < MPH_LEVELS) {
+        const int l = mph->nlevels;
+        const size_t level_words = (2 * n + 63) / 64, nbits = level_words * 64;
+        uint64_t *collided = calloc(level_words, sizeof(uint64_t));
+        bits = realloc(bits, (words + level_words) * sizeof(uint64_t));
+        if (!collided || !bits) {
+            fprintf(stderr, "Out of memory!\n");
+            exit(EXIT_FAILURE);
+        }
+        uint64_t *seen = bits + words;
+        memset(seen, 0, level_words * sizeof(uint64_t));
+        for (size_t i = 0; i < n; i++) {
+            const size_t pos = mph_position(keys[i].key, l, nbits);
+            const uint64_t mask = 1ULL << (pos % 64);
+            if (seen[pos / 64] & mask) collided[pos / 64] |= mask;
+            seen[pos / 64] |= mask;
+        }
+        size_t kept = 0;
+        for (size_t i = 0; i < n; i++) {
+            const size_t pos = mph_position(keys[i].key, l, nbits);
+            if (collided[pos / 64] >> (pos % 64) & 1) keys[kept++] = keys[i];
+        }
+        for (size_t w = 0; w < level_words; w++) seen[w] &= ~collided[w];
+        free(collided);
+        mph->levels[l] = words;
+        words += level_words;
+        mph->levels[l + 1] = words;
+        mph->nlevels++;
+        n = kept;
+    }
+    mph->bits = bits ? bits : calloc(1, sizeof(uint64_t));
+    mph->fallback_hashes = malloc((n ? n : 1) * sizeof(uint64_t));
+    mph->fallback_keys = malloc((n ? n : 1) * sizeof(char *));
+    if (!mph->bits || !mph->fallback_hashes || !mph->fallback_keys) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t j = 0; j < n; j++) {
+        mph->fallback_hashes[j] = keys[j].key;
+        mph->fallback_keys[j] = strdup(record_field(table, table_row(table, keys[j].row), col));
+        if (!mph->fallback_keys[j]) {
+            fprintf(stderr, "Out of memory!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    mph->nfallback = n;
+    mph_rank_init(mph);
+}
+
+// Identity of an input file for the sidecar files written next to it: a sidecar is reused
+// while the file's size, modification time and inode are unchanged.
+typedef struct {
+    uint64_t size;
+    uint64_t mtime_sec;
+    uint64_t mtime_nsec;
+    uint64_t ino;
+    uint64_t dev;
+} file_stamp_t;
+
+static inline file_stamp_t file_stamp(const struct stat *sb) {
+    return (file_stamp_t) {.size = sb->st_size, .mtime_sec = sb->st_mtim.tv_sec, .mtime_nsec = sb->st_mtim.tv_nsec,
+                           .ino = sb->st_ino, .dev = sb->st_dev};
+}
+
+// --sidecars: directory for the sidecar files, NULL to keep them next to their inputs, "" for
+// none at all (neither read nor written).
+static const char *g_sidecar_dir;
+static atomic_int g_sidecar_warned;
+
+// Path of the sidecar of an input file: <file><suffix>, or <dir>/<file name><suffix> with
+// --sidecars=DIR. Returns 0 if there is none.
+static inline int sidecar_path(char *sidecar, const size_t size, const char *path, const char *suffix) {
+    if (g_sidecar_dir && !g_sidecar_dir[0]) return 0;
+    int n;
+    if (g_sidecar_dir) {
+        const char *name = strrchr(path, '/');
+        n = snprintf(sidecar, size, "%s/%s%s", g_sidecar_dir, name ? name + 1 : path, suffix);
+    } else {
+        n = snprintf(sidecar, size, "%s%s", path, suffix);
+    }
+    return n > 0 && (size_t) n < size;
+}
+
+// Failing to write a sidecar only costs the next run a rebuild; the first failure is reported.
+static inline void sidecar_write_failed(const char *sidecar) {
+    if (!atomic_exchange(&g_sidecar_warned, 1)) {
+        fprintf(stderr, "Cannot write %s: %s (see --sidecars)\n", sidecar, strerror(errno));
+    }
+}
+
+// The perfect hash of a file's key column is kept in its sidecar <file>.mph.
+typedef struct {
+    char magic[8];
+    file_stamp_t stamp;
+    int32_t col;
+    int32_t nlevels;
+    uint64_t nkeys;
+    uint64_t nfallback;
+    uint64_t levels[MPH_LEVELS + 1];
+} mph_header_t;
+
+static const char g_mph_magic[8] = "OJMPH01";
+
+static atomic_size_t g_mph_built;
+static atomic_size_t g_mph_loaded;
+static atomic_size_t g_mph_keys;
+static atomic_size_t g_mph_bits;
+
+static inline mph_header_t mph_header(const struct stat *sb, const int col) {
+    mph_header_t header = {.stamp = file_stamp(sb), .col = col};
+    memcpy(header.magic, g_mph_magic, sizeof(header.magic));
+    return header;
+}
+
+// Writes the perfect hash to a temporary file renamed over the sidecar, so readers never see
+// half a file.
+static inline void mph_save(const char *path, const struct stat *sb, const int col, const mph_t *mph) {
+    char sidecar[PATH_MAX], tmp[PATH_MAX + 16];
+    if (!sidecar_path(sidecar, sizeof(sidecar), path, ".mph")) return;
+    snprintf(tmp, sizeof(tmp), "%s.%d", sidecar, (int) getpid());
+    FILE *f = fopen(tmp, "wb");
+    if (!f) {
+        sidecar_write_failed(sidecar);
+        return;
+    }
+
+    mph_header_t header = mph_header(sb, col);
+    header.nlevels = mph->nlevels;
+    header.nkeys = mph->nkeys;
+    header.nfallback = mph->nfallback;
+    memcpy(header.levels, mph->levels, sizeof(header.levels));
+    int ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+             fwrite(mph->bits, sizeof(uint64_t), mph->levels[mph->nlevels], f) == mph->levels[mph->nlevels] &&
+             fwrite(mph->fallback_hashes, sizeof(uint64_t), mph->nfallback, f) == mph->nfallback;
+    for (size_t j = 0; ok && j < mph->nfallback; j++) {
+        ok = fwrite(mph->fallback_keys[j], 1, strlen(mph->fallback_keys[j]) + 1, f) == strlen(mph->fallback_keys[j]) + 1;
+    }
+    if (fclose(f) != 0 || !ok || rename(tmp, sidecar) != 0) {
+        sidecar_write_failed(sidecar);
+        unlink(tmp);
+    }
+}
+
+// Reads the sidecar of the file if it was written for the file as it is now.
+static inline int mph_load(const char *path, const struct stat *sb, const int col, mph_t *mph) {
+    char sidecar[PATH_MAX];
+    if (!sidecar_path(sidecar, sizeof(sidecar), path, ".mph")) return 0;
+    FILE *f = fopen(sidecar, "rb");
+    if (!f) return 0;
+
+    const mph_header_t expected = mph_header(sb, col);
+    mph_header_t header;
+    int ok = fread(&header, sizeof(header), 1, f) == 1 &&
+             memcmp(&header, &expected, offsetof(mph_header_t, nlevels)) == 0 &&
+             header.nlevels >= 0 && header.nlevels <= MPH_LEVELS && header.levels[0] == 0;
+    for (int l = 0; ok && l < header.nlevels; l++) ok = header.levels[l] < header.levels[l + 1];
+    *mph = (mph_t) {0};
+    if (ok) {
+        const size_t words = header.levels[header.nlevels];
+        mph->nlevels = header.nlevels;
+        mph->nkeys = header.nkeys;
+        memcpy(mph->levels, header.levels, sizeof(mph->levels));
+        mph->bits = malloc((words ? words : 1) * sizeof(uint64_t));
+        mph->fallback_hashes = malloc((header.nfallback ? header.nfallback : 1) * sizeof(uint64_t));
+        mph->fallback_keys = calloc(header.nfallback ? header.nfallback : 1, sizeof(char *));
+        ok = mph->bits && mph->fallback_hashes && mph->fallback_keys &&
+             fread(mph->bits, sizeof(uint64_t), words, f) == words &&
+             fread(mph->fallback_hashes, sizeof(uint64_t), header.nfallback, f) == header.nfallback;
+        if (!words) mph->bits[0] = 0;
+    }
+    for (size_t j = 0; ok && j < header.nfallback; j++) {
+        char key[MAX_LINE_LEN + 1];
+        size_t len = 0;
+        int c;
+        while ((c = fgetc(f)) > 0 && len < MAX_LINE_LEN) key[len++] = (char) c;
+        key[len] = '\0';
+        ok = c == 0 && (mph->fallback_keys[j] = strdup(key)) != NULL;
+        mph->nfallback = j + 1;
+    }
+    fclose(f);
+    if (ok) mph_rank_init(mph);
+    ok = ok && mph->nbits_set + mph->nfallback == mph->nkeys;
+    if (!ok) mph_free(mph);
+    return ok;
+}
+
+typedef struct {
+    table_t *table;
+    int col;
+    int nparts;
+    sort_item_t *items;
+} mph_hash_job_t;
+
+static void mph_hash_part(void *arg, const int part) {
+    const mph_hash_job_t *job = arg;
+    const size_t count = job->table->count;
+    for (size_t i = count * part / job->nparts; i < count * (part + 1) / job->nparts; i++) {
+        const char *key = record_field(job->table, table_row(job->table, i), job->col);
+        job->items[i] = (sort_item_t) {.key = key_hash64(key, strlen(key)), .row = i};
+    }
+}
+
+// Chains the rows by the number of their key; 0 if a row's key has no number or two keys
+// share one, i.e. the perfect hash was not built over this table's keys.
+static inline int mph_group_rows(table_t *table, const int col, const sort_item_t *items) {
+    mph_index_t *index = &table->mph;
+    const size_t nkeys = index->mph.nkeys;
+    index->entries = calloc(nkeys ? nkeys : 1, sizeof(uint64_t));
+    index->next = malloc((table->count ? table->count : 1) * sizeof(uint32_t));
+    if (!index->entries || !index->next) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+    // Backwards, so that every chain is in row order
+    for (size_t i = table->count; i-- > 0;) {
+        const size_t k = mph_lookup(&index->mph, items[i].key, record_field(table, table_row(table, i), col));
+        if (k >= nkeys || (index->entries[k] && index->entries[k] >> 32 != items[i].key >> 32)) return 0;
+        index->next[i] = (uint32_t) index->entries[k];
+        index->entries[k] = (items[i].key >> 32) << 32 | (i + 1);
+    }
+    for (size_t k = 0; k < nkeys; k++) {
+        if (!index->entries[k]) return 0;
+    }
+    return 1;
+}
+
+// Builds the perfect hash over the distinct keys among the hashed rows and groups the rows.
+static inline void mph_index_build_keys(table_t *table, const int col, const sort_item_t *items, const int parallel) {
+    const size_t count = table->count;
+    // Distinct keys: sorted by hash, a run of equal hashes holds one key unless two keys collide
+    sort_item_t *keys = malloc((count ? count : 1) * sizeof(sort_item_t));
+    if (!keys) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(keys, items, count * sizeof(sort_item_t));
+    if (parallel) parallel_radix_sort(keys, count, 0, 2);
+    else radix_sort_items(keys, count, 0);
+    size_t nkeys = 0;
+    for (size_t i = 0, run = 0; i < count; i++) {
+        if (i == 0 || keys[i].key != keys[i - 1].key) run = nkeys;
+        const char *key = record_field(table, table_row(table, keys[i].row), col);
+        size_t k = run;
+        while (k < nkeys && strcmp(record_field(table, table_row(table, keys[k].row), col), key) != 0) k++;
+        if (k == nkeys) keys[nkeys++] = keys[i];
+    }
+    mph_build(&table->mph.mph, keys, nkeys, table, col);
+    free(keys);
+    if (!mph_group_rows(table, col, items)) {
+        fprintf(stderr, "Perfect hash build failed!\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Builds the perfect hash index of column col, reading the perfect hash from the sidecar of
+// the file the table was loaded from if it is current and writing it there otherwise.
+static inline void mph_index_build(table_t *table, const int col, const char *path) {
+    mph_index_t *index = &table->mph;
+    if (index->col == col) return;
+    mph_index_free(index);
+    if (table->count >= UINT32_MAX) {
+        fprintf(stderr, "Table too large for a hash index!\n");
+        exit(EXIT_FAILURE);
+    }
+    const size_t count = table->count;
+    sort_item_t *items = table_alloc((count ? count : 1) * sizeof(sort_item_t));
+    if (!items) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+    const int parallel = g_nthreads > 1 && tl_sched && count >= PARALLEL_MIN_ROWS;
+    mph_hash_job_t job = {.table = table, .col = col, .nparts = parallel ? 4 * g_nthreads : 1, .items = items};
+    if (parallel) parallel_for(job.nparts, mph_hash_part, &job);
+    else mph_hash_part(&job, 0);
+
+    struct stat sb;
+    const int cached = path && stat(path, &sb) == 0;
+    if (cached && mph_load(path, &sb, col, &index->mph)) {
+        if (mph_group_rows(table, col, items)) {
+            atomic_fetch_add(&g_mph_loaded, 1);
+        } else {
+            mph_index_free(index);
+        }
+    }
+
+    if (!index->mph.bits) {
+        mph_index_build_keys(table, col, items, parallel);
+        if (cached) mph_save(path, &sb, col, &index->mph);
+        atomic_fetch_add(&g_mph_built, 1);
+    }
+    table_free(items, (count ? count : 1) * sizeof(sort_item_t));
+    atomic_fetch_add(&g_mph_keys, index->mph.nkeys);
+    atomic_fetch_add(&g_mph_bits, index->mph.levels[index->mph.nlevels] * 64);
+    index->count = index->mph.nkeys;
+    index->col = col;
+}
+
+static inline void print_mph_stats(void) {
+    const size_t built = atomic_load(&g_mph_built), loaded = atomic_load(&g_mph_loaded);
+    const size_t keys = atomic_load(&g_mph_keys);
+    if (built || loaded) {
+        fprintf(stderr, "perfect hashes: %zu built, %zu loaded, %.2f bits per key\n", built, loaded,
+                keys ? (double) atomic_load(&g_mph_bits) / keys : 0.0);
+    }
+}
+
+static inline void prefix_sort(table_t *table, const int col, const int key_column) {
+    const size_t count = table->count;
+    if (count < 2) return;
+    sort_item_t *items = table_alloc(count * sizeof(sort_item_t));
+    if (!items) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+    const int parallel = g_nthreads > 1 && tl_sched && count >= PARALLEL_MIN_ROWS;
+    prefix_sort_job_t job = {.table = table, .items = items, .col = col, .nparts = parallel ? 4 * g_nthreads : 1};
+
+    if (parallel) parallel_for(job.nparts, prefix_fill_part, &job);
+    else prefix_fill_part(&job, 0);
+
+    if (g_sort_backend == SORT_RADIX) {
+        if (parallel) parallel_radix_sort(items, count, 0, 2);
+        else radix_sort_items(items, count, 0);
+    } else if (parallel) {
+        int depth = 0;
+        while ((1 << depth) < 4 * g_nthreads) depth++;
+        parallel_items_sort(items, count, depth);
+    } else {
+        items_quicksort(g_sort_kernel, items, count);
+    }
+
+    job.segments = malloc(table->capacity * sizeof(segment_t *));
+    if (!job.segments) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t s = 0; s < table->nsegments; s++) job.segments[s] = segment_alloc();
+    size_t bounds[job.nparts + 1];
+    job.bounds = bounds;
+    prefix_place_bounds(&job);
+    if (parallel) parallel_for(job.nparts, prefix_place_part, &job);
+    else prefix_place_part(&job, 0);
+
+    for (size_t s = 0; s < table->nsegments; s++) segment_free(table->segments[s]);
+    free(table->segments);
+    table->segments = job.segments;
+    if (key_column) key_column_build(table, col, items);
+    table_free(items, count * sizeof(sort_item_t));
+}
+
+// Whether the rows are already sorted on column col, as inputs sorted on disk are. Stops at
+// the first pair out of order, so unsorted tables cost a few compares.
+static inline int rows_in_order(const table_t *table, const int col) {
+    for (size_t i = 1; i < table->count; i++) {
+        const char *prev = record_field(table, table_row(table, i - 1), col);
+        if (strcmp(prev, record_field(table, table_row(table, i), col)) > 0) return 0;
+    }
+    return 1;
+}
+
+// Sorts only if the table is not known to be in that order already, as the output of a
+// join on col is. A table of unknown order is scanned first and left as it is if its rows
+// turn out to be sorted. With key_column set the table also gets the front-coded key column of col.
+static inline void sort_by_column(table_t *table, const int col, const int key_column) {
+    if (table->sorted_col != col && !rows_in_order(table, col)) {
+        key_column_free(&table->keys); // the rows move
+        hash_column_free(&table->hashes);
+        hash_index_free(&table->index);
+        mph_index_free(&table->mph);
+        learned_index_free(&table->model);
+        if (g_sort_backend != SORT_QUICK) {
+            prefix_sort(table, col, key_column);
+        } else if (g_nthreads > 1 && tl_sched) {
+            int depth = 0;
+            while ((1 << depth) < 4 * g_nthreads) depth++;
+            parallel_quicksort(table, 0, table->count, col, depth);
+        } else {
+            sort_rows(table, 0, table->count, col);
+        }
+    }
+    table->sorted_col = col;
+    if (key_column && table->keys.col != col) key_column_build(table, col, NULL);
+}
+
+static atomic_size_t g_model_segments;
+static atomic_size_t g_model_probes;
+static atomic_size_t g_model_rows_off;
+
+static inline void model_segment_add(learned_index_t *model, size_t *capacity, const model_segment_t segment) {
+    if (model->nsegments == *capacity) {
+        *capacity = *capacity ? 2 * *capacity : 64;
+        model->segments = realloc(model->segments, *capacity * sizeof(model_segment_t));
+        if (!model->segments) {
+            fprintf(stderr, "Out of memory!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    model->segments[model->nsegments++] = segment;
+}
+
+// Prefix of a key at a model depth: its bytes 8 * depth to 8 * depth + 7.
+static inline uint64_t model_key(const table_t *table, const uint64_t *prefixes, const size_t row, const int col,
+                                 const int depth) {
+    return depth ? key_prefix(record_field(table, table_row(table, row), col) + 8 * depth) : prefixes[row];
+}
+
+// Fits the segments of rows [begin, end) in one pass over their distinct prefixes
+// (shrinking cone): a segment keeps the range of slopes that predict all its rows within
+// MODEL_ERROR and ends at the first prefix that would leave that range empty. Keys of a
+// nested run have no NUL in their first 8 * depth bytes, so the prefix at depth is in them.
+static void learned_fit(learned_index_t *model, const table_t *table, const uint64_t *prefixes, const int col,
+                        const size_t begin, const size_t end, const int depth) {
+    size_t capacity = 0;
+    model_segment_t segment = {0};
+    int open = 0;
+    double low = 0, high = -1; // slopes of the open segment, high < 0: no upper bound yet
+    for (size_t i = begin, next; i < end; i = next) {
+        const uint64_t key = model_key(table, prefixes, i, col, depth);
+        for (next = i + 1; next < end && model_key(table, prefixes, next, col, depth) == key; next++) {}
+
+        if (next - i > 2 * MODEL_ERROR && (key & 0xff) && depth + 1 < MODEL_DEPTH) {
+            if (open) {
+                segment.slope = high < 0 ? 0 : (low + high) / 2;
+                model_segment_add(model, &capacity, segment);
+                open = 0;
+            }
+            learned_index_t *inner = calloc(1, sizeof(learned_index_t));
+            if (!inner) {
+                fprintf(stderr, "Out of memory!\n");
+                exit(EXIT_FAILURE);
+            }
+            learned_fit(inner, table, prefixes, col, i, next, depth + 1);
+            model_segment_add(model, &capacity, (model_segment_t) {.key = key, .row = i, .inner = inner});
+            continue;
+        }
+        if (open) {
+            const double dx = (double) (key - segment.key), dy = (double) (i - segment.row);
+            const double lo = (dy - MODEL_ERROR) / dx, hi = (dy + MODEL_ERROR) / dx;
+            if ((lo <= high || high < 0) && low <= hi) {
+                if (lo > low) low = lo;
+                if (hi < high || high < 0) high = hi;
+                continue;
+            }
+            segment.slope = (low + high) / 2;
+            model_segment_add(model, &capacity, segment);
+        }
+        segment = (model_segment_t) {.key = key, .row = i};
+        open = 1;
+        low = 0;
+        high = -1;
+    }
+    if (open) {
+        segment.slope = high < 0 ? 0 : (low + high) / 2;
+        model_segment_add(model, &capacity, segment);
+    }
+    model->col = col;
+    atomic_fetch_add(&g_model_segments, model->nsegments);
+}
+
+static inline void learned_index_build(table_t *table, const int col) {
+    learned_index_t *model = &table->model;
+    if (model->col == col) return;
+    learned_index_free(model);
+    sort_by_column(table, col, 0);
+    uint64_t *prefixes = table_alloc((table->count ? table->count : 1) * sizeof(uint64_t));
+    if (!prefixes) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < table->count; i++) prefixes[i] = key_prefix(record_field(table, table_row(table, i), col));
+    learned_fit(model, table, prefixes, col, 0, table->count, 0);
+    model->prefixes = prefixes;
+    model->count = table->count ? table->count : 1;
+
+    // Radix table, so the segment search starts from the segments sharing the prefix's top bits
+    model->radix = malloc(((1 << MODEL_RADIX_BITS) + 1) * sizeof(uint32_t));
+    if (!model->radix || model->nsegments >= UINT32_MAX) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+    size_t s = 0;
+    for (size_t b = 0; b <= 1 << MODEL_RADIX_BITS; b++) {
+        while (s < model->nsegments && model->segments[s].key >> (64 - MODEL_RADIX_BITS) < b) s++;
+        model->radix[b] = (uint32_t) s;
+    }
+}
+
+// Row the model expects the first key not less than key at, at most end.
+static inline size_t learned_predict(const learned_index_t *model, const char *key, size_t end) {
+    for (int depth = 0;; depth++) {
+        const uint64_t prefix = key_prefix(key + 8 * depth);
+        if (model->nsegments == 0) return 0;
+        if (prefix < model->segments[0].key) return model->segments[0].row;
+        size_t low = 0, high = model->nsegments;
+        if (model->radix) {
+            const size_t b = prefix >> (64 - MODEL_RADIX_BITS);
+            low = model->radix[b] ? model->radix[b] - 1 : 0;
+            high = model->radix[b + 1];
+        }
+        while (high - low > 1) { // last segment starting at or before prefix
+            const size_t mid = low + (high - low) / 2;
+            if (model->segments[mid].key <= prefix) low = mid;
+            else high = mid;
+        }
+        // Keys past the last prefix of a segment come at most at the next segment's first row
+        const model_segment_t *segment = &model->segments[low];
+        if (low + 1 < model->nsegments) end = model->segments[low + 1].row;
+        if (segment->inner && prefix == segment->key) {
+            model = segment->inner;
+            continue;
+        }
+        const double row = segment->row + segment->slope * (double) (prefix - segment->key);
+        return row < end ? (size_t) row : end;
+    }
+}
+
+// Whether the key of a row is less than key, whose prefix is prefix: the rows' prefixes
+// decide unless they are equal.
+static inline int model_row_less(const table_t *table, const uint64_t *prefixes, const int col, const size_t row,
+                                 const char *key, const uint64_t prefix) {
+    if (prefixes[row] != prefix) return prefixes[row] < prefix;
+    return strcmp(record_field(table, table_row(table, row), col), key) < 0;
+}
+
+// First row of the table whose column col is not less than key, searched exponentially
+// outwards from guess and then bisected, so a good guess costs a few compares.
+static inline size_t model_lower_bound(const table_t *table, const int col, const char *key, const size_t guess) {
+    const uint64_t *prefixes = table->model.prefixes, prefix = key_prefix(key);
+    const size_t count = table->count;
+    size_t low = 0, high = count, step = 1;
+    if (guess < count && model_row_less(table, prefixes, col, guess, key, prefix)) {
+        low = guess + 1;
+        while (low < count) {
+            const size_t probe = low + step - 1 < count ? low + step - 1 : count - 1;
+            if (!model_row_less(table, prefixes, col, probe, key, prefix)) {
+                high = probe;
+                break;
+            }
+            low = probe + 1;
+            step *= 2;
+        }
+    } else {
+        high = guess;
+        while (high > 0) {
+            const size_t probe = high > step ? high - step : 0;
+            if (model_row_less(table, prefixes, col, probe, key, prefix)) {
+                low = probe + 1;
+                break;
+            }
+            high = probe;
+            step *= 2;
+        }
+    }
+    while (low < high) {
+        const size_t mid = low + (high - low) / 2;
+        if (model_row_less(table, prefixes, col, mid, key, prefix)) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+// Walks the keys of column col in row order, from the key column if the table has one
+// for col and from the rows otherwise.
+typedef struct {
+    const table_t *table;
+    const key_column_t *keys; // NULL: keys are read from the rows
+    int col;
+    size_t row;
+    size_t pos;      // offset of the entry of row + 1 in the key column
+    const char *key; // key of row, NUL terminated
+    size_t len;
+    char *buf;       // decoded key
+    size_t capacity;
+} key_cursor_t;
+
+static inline void key_cursor_init(key_cursor_t *cursor, const table_t *table, const int col) {
+    *cursor = (key_cursor_t) {.table = table, .col = col, .keys = table->keys.col == col ? &table->keys : NULL};
+}
+
+static inline void key_cursor_free(key_cursor_t *cursor) {
+    free(cursor->buf);
+}
+
+// Decodes the entry at pos into buf; returns whether the key equals the previous one.
+static inline int key_cursor_decode(key_cursor_t *cursor) {
+    const uint8_t *entry = cursor->keys->data + cursor->pos;
+    size_t prefix, suffix;
+    entry += get_len(entry, &prefix);
+    entry += get_len(entry, &suffix);
+    if (prefix + suffix + 1 > cursor->capacity) {
+        cursor->capacity = 2 * (prefix + suffix + 1) > 64 ? 2 * (prefix + suffix + 1) : 64;
+        char *buf = realloc(cursor->buf, cursor->capacity);
+        if (!buf) {
+            fprintf(stderr, "Out of memory!\n");
+            exit(EXIT_FAILURE);
+        }
+        cursor->buf = buf;
+    }
+    const int same = prefix == 0 ? suffix == cursor->len && memcmp(cursor->buf, entry, suffix) == 0
+                                 : suffix == 0 && prefix == cursor->len;
+    memcpy(cursor->buf + prefix, entry, suffix);
+    cursor->len = prefix + suffix;
+    cursor->buf[cursor->len] = '\0';
+    cursor->key = cursor->buf;
+    cursor->pos = entry + suffix - cursor->keys->data;
+    return same;
+}
+
+// Moves to the next row; returns whether its key equals the key of the current row.
+static inline int key_cursor_next(key_cursor_t *cursor) {
+    if (++cursor->row >= cursor->table->count) return 0;
+    if (cursor->keys) return key_cursor_decode(cursor);
+    const char *prev = cursor->key;
+    cursor->key = record_field(cursor->table, table_row(cursor->table, cursor->row), cursor->col);
+    cursor->len = strlen(cursor->key);
+    return strcmp(prev, cursor->key) == 0;
+}
+
+// Positions the cursor on row, decoding from the restart of its block.
+static inline void key_cursor_seek(key_cursor_t *cursor, const size_t row) {
+    if (row >= cursor->table->count) {
+        cursor->row = row;
+    } else if (cursor->keys) {
+        cursor->row = row / KEY_BLOCK * KEY_BLOCK;
+        cursor->pos = cursor->keys->restarts[row / KEY_BLOCK];
+        cursor->len = SIZE_MAX;
+        key_cursor_decode(cursor);
+        while (cursor->row < row) key_cursor_next(cursor);
+    } else {
+        cursor->row = row;
+        cursor->key = record_field(cursor->table, table_row(cursor->table, row), cursor->col);
+        cursor->len = strlen(cursor->key);
+    }
+}
+
+// Moves past the run of keys equal to the current one, but not past end.
+static inline void key_cursor_skip_run(key_cursor_t *cursor, const size_t end) {
+    do {
+        if (cursor->row + 1 >= end) {
+            cursor->row = end;
+            return;
+        }
+    } while (key_cursor_next(cursor));
+}
+
+static inline int key_compare(const char *a, const size_t alen, const char *b, const size_t blen) {
+    const int cmp = memcmp(a, b, alen < blen ? alen : blen);
+    return cmp ? cmp : (alen > blen) - (alen < blen);
+}
+
+// Advances the cursor to the first row before end whose key is not less than key: rows
+// ahead at exponentially growing distances are probed until one is not less, then the gap
+// is bisected. Returns the number of rows skipped.
+static inline size_t key_cursor_gallop(key_cursor_t *cursor, const char *key, const size_t len, const size_t end) {
+    key_cursor_t probe;
+    key_cursor_init(&probe, cursor->table, cursor->col);
+    const size_t start = cursor->row;
+    size_t low = start + 1, high = end;
+    for (size_t step = 1; start + step < end; step *= 2) {
+        key_cursor_seek(&probe, start + step);
+        if (key_compare(probe.key, probe.len, key, len) >= 0) {
+            high = start + step;
+            break;
+        }
+        low = start + step + 1;
+    }
+    while (low < high) {
+        const size_t mid = low + (high - low) / 2;
+        key_cursor_seek(&probe, mid);
+        if (key_compare(probe.key, probe.len, key, len) < 0) low = mid + 1;
+        else high = mid;
+    }
+    key_cursor_free(&probe);
+    key_cursor_seek(cursor, low);
+    return low - start;
+}
+
+// Called for every matching pair of a merge join. The field counts are those the kernel is
+// specialized on, 0 if any.
+typedef void (*join_emit_t)(void *ctx, const char *key, const table_t *left, const record_t *lrec, int left_col,
+                            int left_fields, const table_t *right, const record_t *rrec, int right_col, int right_fields);
+
+// A merge join adapts to sparse output: once one side has advanced GALLOP_AFTER times in a
+// row without a match or the other side moving, that side gallops to the other's key
+// instead of stepping, until the next match.
+#define GALLOP_AFTER 8
+
+typedef enum { JOIN_ADAPTIVE, JOIN_MERGE, JOIN_HASH, JOIN_MPH, JOIN_LEARNED } join_mode_t;
+
+static join_mode_t g_join_mode = JOIN_ADAPTIVE;
+static atomic_size_t g_gallops;
+static atomic_size_t g_gallop_rows;
+
+static atomic_size_t g_hash_probes;
+static atomic_size_t g_hash_slots;
+
+static inline void print_join_stats(void) {
+    fprintf(stderr, "merge joins: %zu gallops skipped %zu rows\n", atomic_load(&g_gallops), atomic_load(&g_gallop_rows));
+    const size_t probes = atomic_load(&g_hash_probes);
+    if (probes) {
+        fprintf(stderr, "hash joins: %zu probes, %.2f slots per probe\n", probes,
+                (double) atomic_load(&g_hash_slots) / probes);
+    }
+    const size_t lookups = atomic_load(&g_model_probes);
+    if (lookups) {
+        fprintf(stderr, "learned joins: %zu segments, %zu lookups, %.2f rows off per lookup\n",
+                atomic_load(&g_model_segments), lookups, (double) atomic_load(&g_model_rows_off) / lookups);
+    }
+}
+
+// Merge joins rows [left_begin, left_end) of left with rows [right_begin, ...) of right, both
+// sorted on their join column. With release set, segments are freed once both sides are past them.
+// Instantiated through DEFINE_JOIN with the columns and emit known, so both inline.
+static ALWAYS_INLINE void merge_join(table_t *left, const size_t left_begin, const size_t left_end, const int left_col,
+                                     const int left_fields, table_t *right, const size_t right_begin,
+                                     const int right_col, const int right_fields,
+                                     const int release, const join_emit_t emit, void *ctx) {
+    const size_t right_count = right->count;
+    key_cursor_t lc, rc;
+    key_cursor_init(&lc, left, left_col);
+    key_cursor_init(&rc, right, right_col);
+    key_cursor_seek(&lc, left_begin);
+    key_cursor_seek(&rc, right_begin);
+    const int adaptive = g_join_mode == JOIN_ADAPTIVE;
+    int left_misses = 0, right_misses = 0;
+    size_t gallops = 0, skipped = 0;
+    while (lc.row < left_end && rc.row < right_count) {
+        const int cmp = key_compare(lc.key, lc.len, rc.key, rc.len);
+        if (cmp == 0) {
+            // Runs of equal keys end where the front coding says a key differs
+            const size_t i = lc.row, j = rc.row;
+            key_cursor_skip_run(&lc, left_end);
+            key_cursor_skip_run(&rc, right_count);
+            for (size_t li = i; li < lc.row; li++) {
+                const record_t *lrec = table_row(left, li);
+                const char *lkey = record_field(left, lrec, left_col);
+                for (size_t rj = j; rj < rc.row; rj++) {
+                    emit(ctx, lkey, left, lrec, left_col, left_fields, right, table_row(right, rj), right_col,
+                         right_fields);
+                }
+            }
+            if (release) {
+                table_release_before(left, lc.row);
+                table_release_before(right, rc.row);
+            }
+            left_misses = right_misses = 0;
+        } else if (cmp < 0) {
+            right_misses = 0;
+            if (!adaptive || ++left_misses < GALLOP_AFTER) {
+                key_cursor_next(&lc);
+            } else {
+                skipped += key_cursor_gallop(&lc, rc.key, rc.len, left_end);
+                gallops++;
+            }
+        } else {
+            left_misses = 0;
+            if (!adaptive || ++right_misses < GALLOP_AFTER) {
+                key_cursor_next(&rc);
+            } else {
+                skipped += key_cursor_gallop(&rc, lc.key, lc.len, right_count);
+                gallops++;
+            }
+        }
+    }
+    key_cursor_free(&lc);
+    key_cursor_free(&rc);
+    if (gallops) {
+        atomic_fetch_add(&g_gallops, gallops);
+        atomic_fetch_add(&g_gallop_rows, skipped);
+    }
+}
+
+// Join schemas with specialized kernels: (left column, left fields, right column, right
+// fields) of the pipeline's joins, then its join columns with any field counts (0).
+#define JOIN_SCHEMAS(X) X(1, 2, 1, 2) X(1, 3, 1, 2) X(4, 4, 1, 2) X(1, 0, 1, 0) X(4, 0, 1, 0)
+
+typedef void (*join_kernel_t)(table_t *left, size_t left_begin, size_t left_end, int left_col,
+                              table_t *right, size_t right_begin, int right_col, int release, void *ctx);
+
+#define DEFINE_JOIN(name, emit, LEFT_COL, LEFT_FIELDS, RIGHT_COL, RIGHT_FIELDS)                          \
+    static void name(table_t *left, const size_t left_begin, const size_t left_end, const int left_col, \
+                     table_t *right, const size_t right_begin, const int right_col,                    \
+                     const int release, void *ctx) {                                                   \
+        (void) left_col;                                                                               \
+        (void) right_col;                                                                              \
+        merge_join(left, left_begin, left_end, LEFT_COL, LEFT_FIELDS, right, right_begin, RIGHT_COL,   \
+                   RIGHT_FIELDS, release, emit, ctx);                                                  \
+    }
+
+// Hash joins rows [left_begin, left_end) of left with right through right's hash index;
+// the output follows the order of left. The hashes of left's keys come from its hash column
+// when it was built for left_col (see plan_orders), otherwise every key is hashed here.
+// With release set, left's segments are freed behind the probe.
+static ALWAYS_INLINE void hash_join(table_t *left, const size_t left_begin, const size_t left_end, const int left_col,
+                                    const int left_fields, table_t *right, const int right_col,
+                                    const int right_fields, const int release, const join_emit_t emit, void *ctx) {
+    const hash_index_t *index = &right->index;
+    const uint32_t *hashes = left->hashes.col == left_col ? left->hashes.values : NULL;
+    size_t slots = 0;
+    for (size_t li = left_begin; li < left_end; li++) {
+        const record_t *lrec = table_row(left, li);
+        const char *lkey = record_field(left, lrec, left_col);
+        const uint32_t hash = hashes ? hashes[li] : g_hash_kernel->hash(lkey, strlen(lkey));
+        for (size_t s = hash & index->mask;; s = (s + 1) & index->mask) {
+            const uint64_t slot = atomic_load_explicit(&index->slots[s], memory_order_relaxed);
+            slots++;
+            if (!slot) break;
+            if (slot >> 32 != hash) continue;
+            const record_t *rrec = table_row(right, (uint32_t) slot - 1);
+            if (strcmp(record_field(right, rrec, right_col), lkey) == 0) {
+                emit(ctx, lkey, left, lrec, left_col, left_fields, right, rrec, right_col, right_fields);
+            }
+        }
+        if (release && (li & SEGMENT_MASK) == SEGMENT_MASK) table_release_before(left, li + 1);
+    }
+    atomic_fetch_add(&g_hash_probes, left_end - left_begin);
+    atomic_fetch_add(&g_hash_slots, slots);
+}
+
+#define DEFINE_HASH_JOIN(name, emit, LEFT_COL, LEFT_FIELDS, RIGHT_COL, RIGHT_FIELDS)                     \
+    static void name(table_t *left, const size_t left_begin, const size_t left_end, const int left_col, \
+                     table_t *right, const size_t right_begin, const int right_col,                    \
+                     const int release, void *ctx) {                                                   \
+        (void) left_col;                                                                               \
+        (void) right_col;                                                                              \
+        (void) right_begin;                                                                            \
+        hash_join(left, left_begin, left_end, LEFT_COL, LEFT_FIELDS, right, RIGHT_COL, RIGHT_FIELDS,   \
+                  release, emit, ctx);                                                                 \
+    }
+
+// Hash joins through right's perfect hash index instead: the key's number is the only slot
+// to look at; its fingerprint and one compare with the first row of its chain confirm the match.
+static ALWAYS_INLINE void mph_join(table_t *left, const size_t left_begin, const size_t left_end, const int left_col,
+                                   const int left_fields, table_t *right, const int right_col,
+                                   const int right_fields, const int release, const join_emit_t emit, void *ctx) {
+    const mph_index_t *index = &right->mph;
+    for (size_t li = left_begin; li < left_end; li++) {
+        const record_t *lrec = table_row(left, li);
+        const char *lkey = record_field(left, lrec, left_col);
+        const uint64_t hash = key_hash64(lkey, strlen(lkey));
+        const size_t k = mph_lookup(&index->mph, hash, lkey);
+        const uint64_t entry = k < index->count ? index->entries[k] : 0;
+        uint32_t r = entry >> 32 == hash >> 32 ? (uint32_t) entry : 0;
+        if (r && strcmp(record_field(right, table_row(right, r - 1), right_col), lkey) == 0) {
+            for (; r; r = index->next[r - 1]) {
+                emit(ctx, lkey, left, lrec, left_col, left_fields, right, table_row(right, r - 1), right_col,
+                     right_fields);
+            }
+        }
+        if (release && (li & SEGMENT_MASK) == SEGMENT_MASK) table_release_before(left, li + 1);
+    }
+    atomic_fetch_add(&g_hash_probes, left_end - left_begin);
+    atomic_fetch_add(&g_hash_slots, left_end - left_begin);
+}
+
+#define DEFINE_MPH_JOIN(name, emit, LEFT_COL, LEFT_FIELDS, RIGHT_COL, RIGHT_FIELDS)                      \
+    static void name(table_t *left, const size_t left_begin, const size_t left_end, const int left_col, \
+                     table_t *right, const size_t right_begin, const int right_col,                    \
+                     const int release, void *ctx) {                                                   \
+        (void) left_col;                                                                               \
+        (void) right_col;                                                                              \
+        (void) right_begin;                                                                            \
+        mph_join(left, left_begin, left_end, LEFT_COL, LEFT_FIELDS, right, RIGHT_COL, RIGHT_FIELDS,    \
+                 release, emit, ctx);                                                                  \
+    }
+
+// Learned joins look every left row up in right, sorted on right_col, starting from where
+// right's learned index puts the key; the output follows the order of left. With release
+// set, left's segments are freed behind the lookups.
+static ALWAYS_INLINE void learned_join(table_t *left, const size_t left_begin, const size_t left_end,
+                                       const int left_col, const int left_fields, table_t *right,
+                                       const int right_col, const int right_fields, const int release,
+                                       const join_emit_t emit, void *ctx) {
+    const learned_index_t *model = &right->model;
+    const size_t right_count = right->count;
+    size_t rows_off = 0;
+    for (size_t li = left_begin; li < left_end; li++) {
+        const record_t *lrec = table_row(left, li);
+        const char *lkey = record_field(left, lrec, left_col);
+        const uint64_t prefix = key_prefix(lkey);
+        const size_t guess = learned_predict(model, lkey, right_count);
+        size_t rj = model_lower_bound(right, right_col, lkey, guess);
+        rows_off += rj > guess ? rj - guess : guess - rj;
+        for (; rj < right_count && model->prefixes[rj] == prefix; rj++) {
+            const record_t *rrec = table_row(right, rj);
+            if (strcmp(record_field(right, rrec, right_col), lkey) != 0) break;
+            emit(ctx, lkey, left, lrec, left_col, left_fields, right, rrec, right_col, right_fields);
+        }
+        if (release && (li & SEGMENT_MASK) == SEGMENT_MASK) table_release_before(left, li + 1);
+    }
+    atomic_fetch_add(&g_model_probes, left_end - left_begin);
+    atomic_fetch_add(&g_model_rows_off, rows_off);
+}
+
+#define DEFINE_LEARNED_JOIN(name, emit, LEFT_COL, LEFT_FIELDS, RIGHT_COL, RIGHT_FIELDS)                  \
+    static void name(table_t *left, const size_t left_begin, const size_t left_end, const int left_col, \
+                     table_t *right, const size_t right_begin, const int right_col,                    \
+                     const int release, void *ctx) {                                                   \
+        (void) left_col;                                                                               \
+        (void) right_col;                                                                              \
+        (void) right_begin;                                                                            \
+        learned_join(left, left_begin, left_end, LEFT_COL, LEFT_FIELDS, right, RIGHT_COL, RIGHT_FIELDS, \
+                     release, emit, ctx);                                                              \
+    }
+
+// How joins with right on right_col find the matching rows: merging, or looking them up
+// through one of right's indexes.
+typedef enum { PROBE_MERGE, PROBE_HASH, PROBE_MPH, PROBE_LEARNED } probe_t;
+
+static inline probe_t join_probe(const table_t *right, const int right_col) {
+    if (right->mph.col == right_col) return PROBE_MPH;
+    if (right->index.col == right_col) return PROBE_HASH;
+    if (right->model.col == right_col) return PROBE_LEARNED;
+    return PROBE_MERGE;
+}
+
+// Fields of the table's rows, taken from the first one; 0 if the table is empty.
+static inline int table_fields(const table_t *table) {
+    return table->count ? table_row(table, 0)->nfields : 0;
+}
+
+
+// Appends the joined line of a pair whose rows have lfields and rfields fields.
+static ALWAYS_INLINE void join_line(table_t *out, const char *lkey, const table_t *left, const record_t *lrec,
+                                    const int left_col, const int lfields, const table_t *right,
+                                    const record_t *rrec, const int right_col, const int rfields) {
+
+    // The joined line is the key followed by the other fields of both sides, each copied
+    // as stored; a coded field is only decoded if its output column has another codec or
+    // the columns shift
+    const table_t *tables[2 * MAX_FIELDS];
+    const record_t *records[2 * MAX_FIELDS];
+    int sources[2 * MAX_FIELDS];
+    int nfields = 1;
+    for (int lf = 0; lf < lfields; lf++) {
+        if (lf + 1 == left_col) continue;
+        tables[nfields] = left;
+        records[nfields] = lrec;
+        sources[nfields++] = lf;
+    }
+    for (int rf = 0; rf < rfields; rf++) {
+        if (rf + 1 == right_col) continue;
+        tables[nfields] = right;
+        records[nfields] = rrec;
+        sources[nfields++] = rf;
+    }
+    if (nfields > MAX_FIELDS) nfields = MAX_FIELDS;
+
+    // Calculate the required buffer size for the joined line
+    size_t sizes[MAX_FIELDS];
+    int decode[MAX_FIELDS];
+    size_t line_size = sizes[0] = strlen(lkey) + 1;
+    for (int f = 1; f < nfields; f++) {
+        decode[f] = records[f]->coded >> sources[f] & 1 &&
+                    (tables[f]->codecs[sources[f]] != out->codecs[f] || !lkey[0]);
+        sizes[f] = decode[f] ? field_text_bound(tables[f], records[f], sources[f]) + 8 // with slack
+                             : field_stored_size(tables[f], records[f], sources[f]);
+        line_size += sizes[f];
+    }
+
+    // Allocate buffer for the joined line
+    record_t *record = table_append(out);
+    char *line = heap_alloc(out, line_size, record);
+
+    // Construct the joined line
+    record->nfields = nfields;
+    record->coded = 0;
+    record->fields[0] = 0;
+    memcpy(line, lkey, sizes[0]);
+    size_t pos = sizes[0];
+    for (int f = 1; f < nfields; f++) {
+        if (pos > UINT16_MAX) {
+            fprintf(stderr, "Line too long!\n");
+            exit(EXIT_FAILURE);
+        }
+        record->fields[f] = (uint16_t) pos;
+        if (decode[f]) {
+            pos += field_text(tables[f], records[f], sources[f], line + pos);
+            line[pos++] = '\0';
+        } else {
+            memcpy(line + pos, table_field(tables[f], records[f], sources[f]), sizes[f]);
+            record->coded |= (records[f]->coded >> sources[f] & 1) << f;
+            pos += sizes[f];
+        }
+    }
+
+    // A missing key column is an empty token, which splitting drops
+    if (!lkey[0]) {
+        memmove(record->fields, record->fields + 1, --record->nfields * sizeof(uint16_t));
+    }
+}
+
+// Rows of the kernel's schema take the copy of join_line whose field loops are unrolled.
+static ALWAYS_INLINE void emit_record(void *ctx, const char *lkey, const table_t *left, const record_t *lrec,
+                                      const int left_col, const int left_fields, const table_t *right,
+                                      const record_t *rrec, const int right_col, const int right_fields) {
+    if (left_fields && lrec->nfields == left_fields && rrec->nfields == right_fields) {
+        join_line(ctx, lkey, left, lrec, left_col, left_fields, right, rrec, right_col, right_fields);
+    } else {
+        join_line(ctx, lkey, left, lrec, left_col, lrec->nfields, right, rrec, right_col, rrec->nfields);
+    }
+}
+
+DEFINE_JOIN(join_records_any, emit_record, left_col, 0, right_col, 0)
+DEFINE_HASH_JOIN(hash_records_any, emit_record, left_col, 0, right_col, 0)
+DEFINE_MPH_JOIN(mph_records_any, emit_record, left_col, 0, right_col, 0)
+DEFINE_LEARNED_JOIN(learned_records_any, emit_record, left_col, 0, right_col, 0)
+#define X(LC, LF, RC, RF)                                                                 \
+    DEFINE_JOIN(join_records_##LC##_##LF##_##RC##_##RF, emit_record, LC, LF, RC, RF)      \
+    DEFINE_HASH_JOIN(hash_records_##LC##_##LF##_##RC##_##RF, emit_record, LC, LF, RC, RF)  \
+    DEFINE_MPH_JOIN(mph_records_##LC##_##LF##_##RC##_##RF, emit_record, LC, LF, RC, RF)      \
+    DEFINE_LEARNED_JOIN(learned_records_##LC##_##LF##_##RC##_##RF, emit_record, LC, LF, RC, RF)
+JOIN_SCHEMAS(X)
+#undef X
+
+// Joins into a table, picked once per join: a lookup through right's index on right_col if
+// it has one, a merge join otherwise.
+static inline join_kernel_t join_records_for(const table_t *left, const int left_col,
+                                             const table_t *right, const int right_col) {
+    const int lfields = table_fields(left), rfields = table_fields(right);
+    const probe_t probe = join_probe(right, right_col);
+#define X(LC, LF, RC, RF)                                                                              \
+    if (left_col == LC && right_col == RC && (!LF || (lfields == LF && rfields == RF))) {              \
+        const join_kernel_t kernels[] = {[PROBE_MERGE] = join_records_##LC##_##LF##_##RC##_##RF,       \
+                                         [PROBE_HASH] = hash_records_##LC##_##LF##_##RC##_##RF,        \
+                                         [PROBE_MPH] = mph_records_##LC##_##LF##_##RC##_##RF,          \
+                                         [PROBE_LEARNED] = learned_records_##LC##_##LF##_##RC##_##RF}; \
+        return kernels[probe];                                                                         \
+    }
+    JOIN_SCHEMAS(X)
+#undef X
+    const join_kernel_t kernels[] = {[PROBE_MERGE] = join_records_any, [PROBE_HASH] = hash_records_any,
+                                     [PROBE_MPH] = mph_records_any, [PROBE_LEARNED] = learned_records_any};
+    return kernels[probe];
+}
+
+// Output columns of a join take the codecs of the input columns they come from, except
+// the text columns.
+static inline void join_codecs(table_t *joined, const table_t *left, const int left_col,
+                               const table_t *right, const int right_col) {
+    if (left->count == 0 || right->count == 0) return;
+    const int lfields = table_row(left, 0)->nfields, rfields = table_row(right, 0)->nfields;
+    int f = 1;
+    for (int lf = 0; lf < lfields && f < MAX_FIELDS; lf++) {
+        if (lf + 1 != left_col) joined->codecs[f++] = left->codecs[lf];
+    }
+    for (int rf = 0; rf < rfields && f < MAX_FIELDS; rf++) {
+        if (rf + 1 != right_col) joined->codecs[f++] = right->codecs[rf];
+    }
+    // Fields landing in a later join's key column are decoded, whatever row shape they come from
+    for (f = 1; f < MAX_FIELDS; f++) {
+        if (joined->text_cols >> (f + 1) & 1) joined->codecs[f] = NULL;
+    }
+}
+
+// First row of the table whose column col is not less than key. With a key column only
+// the restarts are binary searched, then one block is decoded.
+static inline size_t lower_bound(const table_t *table, const int col, const char *key) {
+    size_t low = 0, high = table->count;
+    if (table->keys.col != col) {
+        while (low < high) {
+            const size_t mid = low + (high - low) / 2;
+            if (strcmp(record_field(table, table_row(table, mid), col), key) < 0) low = mid + 1;
+            else high = mid;
+        }
+        return low;
+    }
+
+    const key_column_t *keys = &table->keys;
+    const size_t len = strlen(key);
+    high = (table->count + KEY_BLOCK - 1) / KEY_BLOCK;
+    while (low < high) { // first block whose restart key is not less than key
+        const size_t mid = low + (high - low) / 2;
+        const uint8_t *entry = keys->data + keys->restarts[mid];
+        size_t prefix, suffix;
+        entry += get_len(entry, &prefix);
+        entry += get_len(entry, &suffix);
+        if (key_compare((const char *) entry, suffix, key, len) < 0) low = mid + 1;
+        else high = mid;
+    }
+    if (low == 0) return 0;
+
+    key_cursor_t cursor;
+    key_cursor_init(&cursor, table, col);
+    key_cursor_seek(&cursor, (low - 1) * KEY_BLOCK);
+    const size_t end = low * KEY_BLOCK < table->count ? low * KEY_BLOCK : table->count;
+    while (cursor.row < end && key_compare(cursor.key, cursor.len, key, len) < 0) key_cursor_next(&cursor);
+    key_cursor_free(&cursor);
+    return cursor.row < end ? cursor.row : end;
+}
+
+// Moves a split point forward so that no run of equal keys is cut in two.
+static inline size_t align_to_key(const table_t *table, const int col, size_t pos) {
+    if (pos == 0 || pos >= table->count) return pos;
+    key_cursor_t cursor;
+    key_cursor_init(&cursor, table, col);
+    key_cursor_seek(&cursor, pos - 1);
+    key_cursor_skip_run(&cursor, table->count);
+    key_cursor_free(&cursor);
+    return cursor.row;
+}
+
+typedef struct {
+    table_t *left;
+    table_t *right;
+    int left_col;
+    int right_col;
+    int nparts;
+    table_t *parts;
+    join_kernel_t join;
+} join_job_t;
+
+// Rows [begin, end) of the left table that the part-th of nparts slices of a join reads,
+// and the first right row they can match; returns 0 if the slice is empty. Merge join
+// slices start and end on key boundaries; hash join slices need no alignment.
+static inline int join_slice(const table_t *left, const int left_col, const table_t *right, const int right_col,
+                             const int part, const int nparts, size_t *begin, size_t *end, size_t *right_begin) {
+    const size_t count = left->count;
+    if (join_probe(right, right_col) != PROBE_MERGE) {
+        *begin = count * part / nparts;
+        *end = count * (part + 1) / nparts;
+        *right_begin = 0;
+        return *begin < *end;
+    }
+    *begin = align_to_key(left, left_col, count * part / nparts);
+    *end = align_to_key(left, left_col, count * (part + 1) / nparts);
+    if (*begin >= *end) return 0;
+    *right_begin = lower_bound(right, right_col, record_field(left, table_row(left, *begin), left_col));
+    return 1;
+}
+
+// Joins the part-th key-aligned slice of the left table.
+static void join_part(void *arg, const int part) {
+    const join_job_t *job = arg;
+    size_t begin, end, right_begin;
+    if (!join_slice(job->left, job->left_col, job->right, job->right_col, part, job->nparts,
+                    &begin, &end, &right_begin)) {
+        return;
+    }
+    job->join(job->left, begin, end, job->left_col, job->right, right_begin, job->right_col, 0, &job->parts[part]);
+}
+
+// Joins into a new table, merging or, if right has a hash index on right_col, probing it.
+// With several workers the left table is split into slices whose results are concatenated
+// in order, so a merge join's output stays sorted on the join key and a hash join's in the
+// order of left. A sequential join with release set frees the inputs segment by segment.
+static inline void join_on_columns(table_t *left, const int left_col,
+                                   table_t *right, const int right_col, table_t *joined, const int release) {
+    join_codecs(joined, left, left_col, right, right_col);
+    // The key comes first, and the rows are in key order unless a hash join reads left out of it
+    joined->sorted_col = join_probe(right, right_col) == PROBE_MERGE || left->sorted_col == left_col ? 1 : 0;
+    const join_kernel_t join = join_records_for(left, left_col, right, right_col);
+    if (g_nthreads == 1 || !tl_sched || left->count < PARALLEL_MIN_ROWS) {
+        join(left, 0, left->count, left_col, right, 0, right_col, release, joined);
+        return;
+    }
+
+    const int nparts = 4 * g_nthreads;
+    table_t parts[nparts];
+    memset(parts, 0, sizeof(parts));
+    joined->heap = heap_create();
+    for (int p = 0; p < nparts; p++) {
+        parts[p].heap = joined->heap;
+        memcpy(parts[p].codecs, joined->codecs, sizeof(joined->codecs));
+    }
+
+    join_job_t job = {.left = left, .right = right, .left_col = left_col, .right_col = right_col,
+                      .nparts = nparts, .parts = parts, .join = join};
+    parallel_for(nparts, join_part, &job);
+    table_concat(joined, parts, nparts);
+}
+
+static inline void print_records_as_csv(const table_t *table) {
+    for (size_t i = 0; i < table->count; i++) {
+        const record_t *record = table_row(table, i);
+        for (int f = 0; f < record->nfields; f++) {
+            if (f > 0) printf(",");
+            char text[field_text_bound(table, record, f) + 8];
+            printf("%.*s", (int) field_text(table, record, f, text), text);
+        }
+        printf("\n");
+    }
+}
+
+// Output subsystem: join workers fill output buffers and push them into a lock-free
+// multi-producer single-consumer queue that a dedicated writer thread drains with
+// large writes. Written buffers go back to a lock-free free-list. The pool is bounded,
+// so producers block on a futex while the writer is behind (backpressure).
+typedef struct mpsc_node {
+    struct mpsc_node *_Atomic next;
+} mpsc_node_t;
+
+// Vyukov's intrusive MPSC queue: producers swap themselves in at the head, the
+// consumer walks from the tail. The stub node keeps the queue non-empty.
+typedef struct {
+    mpsc_node_t *_Atomic head;
+    mpsc_node_t *tail;
+    mpsc_node_t stub;
+} mpsc_queue_t;
+
+static inline void mpsc_init(mpsc_queue_t *queue) {
+    atomic_store_explicit(&queue->stub.next, NULL, memory_order_relaxed);
+    atomic_store_explicit(&queue->head, &queue->stub, memory_order_relaxed);
+    queue->tail = &queue->stub;
+}
+
+static inline void mpsc_push(mpsc_queue_t *queue, mpsc_node_t *node) {
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    mpsc_node_t *prev = atomic_exchange_explicit(&queue->head, node, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+// Returns NULL when the queue is empty or a producer is halfway through a push.
+static inline mpsc_node_t *mpsc_pop(mpsc_queue_t *queue) {
+    mpsc_node_t *tail = queue->tail;
+    mpsc_node_t *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if (tail == &queue->stub) {
+        if (!next) return NULL;
+        queue->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    }
+    if (next) {
+        queue->tail = next;
+        return tail;
+    }
+    if (tail != atomic_load_explicit(&queue->head, memory_order_acquire)) return NULL;
+
+    mpsc_push(queue, &queue->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next) {
+        queue->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+typedef struct {
+    mpsc_node_t node; // must be first
+    _Atomic uint32_t free_next;
+    size_t len;
+    char data[OUTBUF_SIZE];
+} outbuf_t;
+
+typedef struct {
+    outbuf_t *buffers;
+    int nbuffers;
+    _Atomic uint64_t free_head; // (ABA tag << 32) | (buffer index + 1), 0 = empty
+    mpsc_queue_t queue;
+    atomic_int done;
+    int fd;
+    pthread_t thread;
+
+    // Futex words, bumped on every release / submit so that sleepers never miss a wakeup
+    _Atomic uint32_t free_seq;
+    _Atomic uint32_t queue_seq;
+    atomic_int free_waiters;
+    atomic_int writer_waiting;
+} writer_t;
+
+static writer_t g_writer;
+static int g_outbuf_count; // 0 = two per thread
+
+static inline void futex_wait(_Atomic uint32_t *word, const uint32_t expected) {
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static inline void futex_wake_all(_Atomic uint32_t *word) {
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0);
+}
+
+static inline void outbuf_release(writer_t *writer, outbuf_t *buf) {
+    const uint32_t index = (uint32_t) (buf - writer->buffers) + 1;
+    uint64_t old = atomic_load_explicit(&writer->free_head, memory_order_relaxed);
+    uint64_t new;
+    do {
+        atomic_store_explicit(&buf->free_next, (uint32_t) old, memory_order_relaxed);
+        new = ((old >> 32) + 1) << 32 | index;
+    } while (!atomic_compare_exchange_weak_explicit(&writer->free_head, &old, new,
+                                                    memory_order_release, memory_order_relaxed));
+
+    atomic_fetch_add(&writer->free_seq, 1);
+    if (atomic_load(&writer->free_waiters) > 0) futex_wake_all(&writer->free_seq);
+}
+
+// Blocks while every buffer is in flight, which throttles producers to the writer's pace.
+static inline outbuf_t *outbuf_acquire(writer_t *writer) {
+    uint32_t seq = atomic_load(&writer->free_seq);
+    uint64_t old = atomic_load_explicit(&writer->free_head, memory_order_acquire);
+    for (;;) {
+        const uint32_t index = (uint32_t) old;
+        if (index == 0) {
+            atomic_fetch_add(&writer->free_waiters, 1);
+            futex_wait(&writer->free_seq, seq);
+            atomic_fetch_sub(&writer->free_waiters, 1);
+            seq = atomic_load(&writer->free_seq);
+            old = atomic_load_explicit(&writer->free_head, memory_order_acquire);
+            continue;
+        }
+        outbuf_t *buf = &writer->buffers[index - 1];
+        const uint64_t new = ((old >> 32) + 1) << 32 | atomic_load_explicit(&buf->free_next, memory_order_relaxed);
+        if (atomic_compare_exchange_weak_explicit(&writer->free_head, &old, new,
+                                                  memory_order_acquire, memory_order_acquire)) {
+            buf->len = 0;
+            tl_stats->outbufs++;
+            return buf;
+        }
+    }
+}
+
+static inline void outbuf_submit(writer_t *writer, outbuf_t *buf) {
+    if (buf->len == 0) {
+        outbuf_release(writer, buf);
+        return;
+    }
+    mpsc_push(&writer->queue, &buf->node);
+
+    atomic_fetch_add(&writer->queue_seq, 1);
+    if (atomic_load(&writer->writer_waiting)) futex_wake_all(&writer->queue_seq);
+}
+
+static inline void write_fully(const int fd, const char *data, size_t len) {
+    while (len > 0) {
+        const ssize_t written = write(fd, data, len);
+        if (written < 0) {
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        data += written;
+        len -= (size_t) written;
+    }
+}
+
+static void *writer_main(void *arg) {
+    writer_t *writer = arg;
+    thread_bind(ROLE_WRITER, 0);
+
+    for (;;) {
+        const uint32_t seq = atomic_load(&writer->queue_seq);
+        outbuf_t *buf = (outbuf_t *) mpsc_pop(&writer->queue);
+        if (buf) {
+            write_fully(writer->fd, buf->data, buf->len);
+            outbuf_release(writer, buf);
+        } else if (atomic_load_explicit(&writer->done, memory_order_acquire)) {
+            // Producers are finished, so an empty pop now means the queue is drained
+            if (!(buf = (outbuf_t *) mpsc_pop(&writer->queue))) return NULL;
+            write_fully(writer->fd, buf->data, buf->len);
+            outbuf_release(writer, buf);
+        } else {
+            atomic_store(&writer->writer_waiting, 1);
+            futex_wait(&writer->queue_seq, seq);
+            atomic_store(&writer->writer_waiting, 0);
+        }
+    }
+}
+
+static inline void writer_start(writer_t *writer, const int fd, const int nbuffers) {
+    writer->nbuffers = nbuffers;
+    writer->buffers = table_alloc(nbuffers * sizeof(outbuf_t));
+    if (!writer->buffers) {
+        fprintf(stderr, "Out of memory for output buffers!\n");
+        exit(EXIT_FAILURE);
+    }
+    atomic_init(&writer->free_head, 0);
+    atomic_init(&writer->free_seq, 0);
+    atomic_init(&writer->queue_seq, 0);
+    atomic_init(&writer->free_waiters, 0);
+    atomic_init(&writer->writer_waiting, 0);
+    for (int b = 0; b < nbuffers; b++) {
+        outbuf_release(writer, &writer->buffers[b]);
+    }
+    mpsc_init(&writer->queue);
+    atomic_init(&writer->done, 0);
+    writer->fd = fd;
+    if (pthread_create(&writer->thread, NULL, writer_main, writer) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Waits until everything submitted so far has been written.
+static inline void writer_finish(writer_t *writer) {
+    atomic_store_explicit(&writer->done, 1, memory_order_release);
+    atomic_fetch_add(&writer->queue_seq, 1);
+    futex_wake_all(&writer->queue_seq);
+    pthread_join(writer->thread, NULL);
+    table_free(writer->buffers, writer->nbuffers * sizeof(outbuf_t));
+}
+
+// Formats a row and its newline at ptr; returns the end.
+static inline char *format_row(const table_t *table, const record_t *record, char *ptr) {
+    size_t remaining = MAX_LINE_LEN; // Track remaining line space
+
+    for (int f = 0; f < record->nfields; f++) {
+        if (f > 0) { // Add delimiter before every field except the first
+            *ptr++ = ',';
+            remaining--;
+        }
+
+        // Copy the field into the buffer, decoding coded fields first
+        const char *field = table_field(table, record, f);
+        char text[record->coded >> f & 1 ? field_text_bound(table, record, f) + 8 : 1];
+        size_t len;
+        if (record->coded >> f & 1) {
+            len = field_text(table, record, f, text);
+            field = text;
+        } else {
+            len = strnlen(field, remaining);
+        }
+        if (len < remaining) {
+            memcpy(ptr, field, len);
+            ptr += len;
+            remaining -= len;
+        } else {
+            fprintf(stderr, "Record exceeds maximum line length!\n");
+            break;
+        }
+    }
+
+    *ptr++ = '\n';
+    return ptr;
+}
+
+// Formats a text row of nfields fields like format_row, with the field loops unrolled for a
+// constant nfields. Returns NULL if the row exceeds MAX_LINE_LEN, for format_row to report.
+static ALWAYS_INLINE char *format_text_row(const table_t *table, const record_t *record, const int nfields,
+                                           char *ptr) {
+    const char *fields[MAX_FIELDS];
+    size_t lens[MAX_FIELDS];
+    size_t line_len = nfields; // delimiters and newline
+#pragma GCC unroll 8 // MAX_FIELDS, so a constant nfields leaves no loop
+    for (int f = 0; f < nfields; f++) {
+        fields[f] = table_field(table, record, f);
+        lens[f] = strlen(fields[f]);
+        line_len += lens[f];
+    }
+    if (line_len > MAX_LINE_LEN) return NULL;
+#pragma GCC unroll 8
+    for (int f = 0; f < nfields; f++) {
+        memcpy(ptr, fields[f], lens[f]);
+        ptr += lens[f];
+        *ptr++ = ',';
+    }
+    ptr[-1] = '\n';
+    return ptr;
+}
+
+// Formats rows [begin, end) into output buffers; the writer thread writes buffer k while
+// buffer k+1 is being filled. Text rows of nfields fields (if not 0) take format_text_row.
+static ALWAYS_INLINE void print_rows(const table_t *table, const size_t begin, const size_t end,
+                                     const int nfields) {
+    outbuf_t *buf = outbuf_acquire(&g_writer);
+
+    for (size_t i = begin; i < end; i++) {
+        const record_t *record = table_row(table, i);
+        if (buf->len + MAX_LINE_LEN + 1 > OUTBUF_SIZE) {
+            outbuf_submit(&g_writer, buf);
+            buf = outbuf_acquire(&g_writer);
+        }
+
+        char *ptr = buf->data + buf->len; // Pointer to the current position in the buffer
+        char *next = nfields && record->nfields == nfields && !record->coded
+                     ? format_text_row(table, record, nfields, ptr) : NULL;
+        buf->len = (next ? next : format_row(table, record, ptr)) - buf->data;
+    }
+
+    outbuf_submit(&g_writer, buf);
+}
+
+// Row formatters specialized on the field count of the printed table's rows.
+#define ROW_FIELDS(X) X(2) X(3) X(4) X(5)
+
+typedef void (*rows_print_t)(const table_t *table, size_t begin, size_t end);
+
+static void print_rows_any(const table_t *table, const size_t begin, const size_t end) {
+    print_rows(table, begin, end, 0);
+}
+
+#define X(N)                                                                             \
+    static void print_rows_##N(const table_t *table, const size_t begin, const size_t end) { \
+        print_rows(table, begin, end, N);                                                \
+    }
+ROW_FIELDS(X)
+#undef X
+
+// Picked once per table from the field count of its first row.
+static inline rows_print_t print_rows_for(const table_t *table) {
+    switch (table_fields(table)) {
+#define X(N) case N: return print_rows_##N;
+        ROW_FIELDS(X)
+#undef X
+        default: return print_rows_any;
+    }
+}
+
+typedef struct {
+    const table_t *table;
+    rows_print_t print;
+    int nparts;
+} print_job_t;
+
+static void print_part(void *arg, const int part) {
+    const print_job_t *job = arg;
+    const size_t count = job->table->count;
+    job->print(job->table, count * part / job->nparts, count * (part + 1) / job->nparts);
+}
+
+// With several workers the table is formatted in slices, so the row order of the output
+// is not deterministic.
+static inline void print_records_as_csv_buffered(const table_t *table) {
+    const rows_print_t print = print_rows_for(table);
+    if (g_nthreads == 1 || !tl_sched || table->count < PARALLEL_MIN_ROWS) {
+        print(table, 0, table->count);
+        return;
+    }
+    print_job_t job = {.table = table, .print = print, .nparts = 4 * g_nthreads};
+    parallel_for(job.nparts, print_part, &job);
+}
+
+typedef struct {
+    writer_t *writer;
+    outbuf_t *buf;
+} output_t;
+
+// Formats a joined row straight into the output buffer, like join_on_columns + print would.
+static ALWAYS_INLINE void output_line(output_t *out, const char *lkey, const table_t *left, const record_t *lrec,
+                                      const int left_col, const int lfields, const table_t *right,
+                                      const record_t *rrec, const int right_col, const int rfields) {
+
+    const table_t *tables[2 * MAX_FIELDS];
+    const record_t *records[2 * MAX_FIELDS];
+    int sources[2 * MAX_FIELDS];
+    int nfields = 1;
+    for (int lf = 0; lf < lfields; lf++) {
+        if (lf + 1 == left_col) continue;
+        tables[nfields] = left;
+        records[nfields] = lrec;
+        sources[nfields++] = lf;
+    }
+    for (int rf = 0; rf < rfields; rf++) {
+        if (rf + 1 == right_col) continue;
+        tables[nfields] = right;
+        records[nfields] = rrec;
+        sources[nfields++] = rf;
     }
+    if (nfields > MAX_FIELDS) nfields = MAX_FIELDS;
 
-    size_t filesize = sb.st_size;
-    char *mapped = mmap(NULL, filesize, PROT_READ, MAP_PRIVATE, fd, 0);
-    if (mapped == MAP_FAILED) {
-        perror("mmap");
-        close(fd);
-        exit(EXIT_FAILURE);
+    // Coded fields are decoded straight into the buffer, so reserve their longest text
+    const char *fields[MAX_FIELDS];
+    size_t lens[MAX_FIELDS]; // text length, 0 for coded fields
+    fields[0] = lkey;
+    lens[0] = strlen(lkey);
+    size_t line_size = lens[0] + 1 + 8; // slack for the decoder
+    for (int f = 1; f < nfields; f++) {
+        const int coded = records[f]->coded >> sources[f] & 1;
+        fields[f] = table_field(tables[f], records[f], sources[f]);
+        lens[f] = coded ? 0 : strlen(fields[f]);
+        line_size += (coded ? field_text_bound(tables[f], records[f], sources[f]) : lens[f]) + 1;
     }
 
-    close(fd); // Close the file descriptor after mapping
+    if (out->buf->len + line_size > OUTBUF_SIZE) {
+        outbuf_submit(out->writer, out->buf);
+        out->buf = outbuf_acquire(out->writer);
+    }
+
+    // Same rules as format_row: a missing key column is an empty token, which splitting drops,
+    // and a row stops before the field that would reach MAX_LINE_LEN
+    char *const line = out->buf->data + out->buf->len;
+    char *ptr = line;
+    const int first = lkey[0] ? 0 : 1;
+    for (int f = first; f < nfields; f++) {
+        if (f > first) *ptr++ = ',';
+        char *const field = ptr;
+        if (f > 0 && lens[f] == 0) {
+            ptr += field_text(tables[f], records[f], sources[f], ptr);
+        } else {
+            memcpy(ptr, fields[f], lens[f]);
+            ptr += lens[f];
+        }
+        if (ptr - line >= MAX_LINE_LEN) {
+            fprintf(stderr, "Record exceeds maximum line length!\n");
+            ptr = field;
+            break;
+        }
+    }
+    *ptr++ = '\n';
+    out->buf->len = ptr - out->buf->data;
+}
+
+static ALWAYS_INLINE void emit_output(void *ctx, const char *lkey, const table_t *left, const record_t *lrec,
+                                      const int left_col, const int left_fields, const table_t *right,
+                                      const record_t *rrec, const int right_col, const int right_fields) {
+    if (left_fields && lrec->nfields == left_fields && rrec->nfields == right_fields) {
+        output_line(ctx, lkey, left, lrec, left_col, left_fields, right, rrec, right_col, right_fields);
+    } else {
+        output_line(ctx, lkey, left, lrec, left_col, lrec->nfields, right, rrec, right_col, rrec->nfields);
+    }
+}
+
+DEFINE_JOIN(join_output_any, emit_output, left_col, 0, right_col, 0)
+DEFINE_HASH_JOIN(hash_output_any, emit_output, left_col, 0, right_col, 0)
+DEFINE_MPH_JOIN(mph_output_any, emit_output, left_col, 0, right_col, 0)
+DEFINE_LEARNED_JOIN(learned_output_any, emit_output, left_col, 0, right_col, 0)
+#define X(LC, LF, RC, RF)                                                                 \
+    DEFINE_JOIN(join_output_##LC##_##LF##_##RC##_##RF, emit_output, LC, LF, RC, RF)       \
+    DEFINE_HASH_JOIN(hash_output_##LC##_##LF##_##RC##_##RF, emit_output, LC, LF, RC, RF)  \
+    DEFINE_MPH_JOIN(mph_output_##LC##_##LF##_##RC##_##RF, emit_output, LC, LF, RC, RF)      \
+    DEFINE_LEARNED_JOIN(learned_output_##LC##_##LF##_##RC##_##RF, emit_output, LC, LF, RC, RF)
+JOIN_SCHEMAS(X)
+#undef X
+
+// Joins straight into the output buffers, picked once per join task like join_records_for.
+static inline join_kernel_t join_output_for(const table_t *left, const int left_col,
+                                            const table_t *right, const int right_col) {
+    const int lfields = table_fields(left), rfields = table_fields(right);
+    const probe_t probe = join_probe(right, right_col);
+#define X(LC, LF, RC, RF)                                                                             \
+    if (left_col == LC && right_col == RC && (!LF || (lfields == LF && rfields == RF))) {             \
+        const join_kernel_t kernels[] = {[PROBE_MERGE] = join_output_##LC##_##LF##_##RC##_##RF,       \
+                                         [PROBE_HASH] = hash_output_##LC##_##LF##_##RC##_##RF,        \
+                                         [PROBE_MPH] = mph_output_##LC##_##LF##_##RC##_##RF,          \
+                                         [PROBE_LEARNED] = learned_output_##LC##_##LF##_##RC##_##RF}; \
+        return kernels[probe];                                                                        \
+    }
+    JOIN_SCHEMAS(X)
+#undef X
+    const join_kernel_t kernels[] = {[PROBE_MERGE] = join_output_any, [PROBE_HASH] = hash_output_any,
+                                     [PROBE_MPH] = mph_output_any, [PROBE_LEARNED] = learned_output_any};
+    return kernels[probe];
+}
+
+// Sparse index of an input file sorted on its first column, kept in its sidecar <file>.idx:
+// the byte offset and key of every SPARSE_INTERVAL-th row. With --load=selective the last
+// file is loaded after join123, and if its index is current only the blocks of rows that
+// can hold one of join123's keys are read, with pread.
+#define SPARSE_INTERVAL 1024
 
-    const size_t capacity = MAX_CAPACITY;
-    record_t *records = malloc(capacity * sizeof(record_t));
-    if (!records) {
+typedef enum { LOAD_FULL, LOAD_SELECTIVE } load_mode_t;
+
+static load_mode_t g_load_mode = LOAD_FULL;
+
+typedef struct {
+    uint64_t *offsets; // offset of the first line of every block
+    char **keys;       // key of that line
+    char *text;        // the keys, NUL terminated
+    size_t text_size;
+    size_t nentries;
+    size_t rows;
+} sparse_index_t;
+
+typedef struct {
+    char magic[8];
+    file_stamp_t stamp;
+    uint64_t interval;
+    uint64_t nentries;
+    uint64_t rows;
+    uint64_t text_size;
+} sparse_header_t;
+
+static const char g_sparse_magic[8] = "OJIDX01";
+
+static atomic_size_t g_selective_loads;
+static atomic_size_t g_selective_bytes;
+static atomic_size_t g_selective_file_bytes;
+
+static inline void sparse_index_free(sparse_index_t *index) {
+    free(index->offsets);
+    free(index->keys);
+    free(index->text);
+    *index = (sparse_index_t) {0};
+}
+
+// First column of a line as the parser splits it: empty fields before it are skipped.
+static inline const char *line_key(const char *line, const size_t len, size_t *key_len) {
+    size_t begin = 0;
+    while (begin < len && line[begin] == ',') begin++;
+    size_t end = begin;
+    while (end < len && line[end] != ',') end++;
+    *key_len = end - begin;
+    return line + begin;
+}
+
+// Scans the file's lines like parse_lines; 0 if the rows are not sorted on their key.
+static inline int sparse_index_scan(const char *data, const size_t size, sparse_index_t *index) {
+    size_t capacity = 0, text_capacity = 0;
+    const char *prev = NULL;
+    size_t prev_len = 0;
+    for (const char *line = data; line < data + size;) {
+        const char *eol = g_scan_kernel->find_eol(line, data + size);
+        size_t len = eol - line;
+        if (len > 0) {
+            if (line[len - 1] == '\r') len--;
+            size_t key_len;
+            const char *key = line_key(line, len, &key_len);
+            if (prev && key_compare(prev, prev_len, key, key_len) > 0) return 0;
+            if (index->rows % SPARSE_INTERVAL == 0) {
+                if (index->nentries == capacity) {
+                    capacity = capacity ? 2 * capacity : 256;
+                    index->offsets = realloc(index->offsets, capacity * sizeof(uint64_t));
+                }
+                if (index->text_size + key_len + 1 > text_capacity) {
+                    text_capacity = 2 * (index->text_size + key_len + 1);
+                    index->text = realloc(index->text, text_capacity);
+                }
+                if (!index->offsets || !index->text) {
+                    fprintf(stderr, "Out of memory!\n");
+                    exit(EXIT_FAILURE);
+                }
+                index->offsets[index->nentries++] = line - data;
+                memcpy(index->text + index->text_size, key, key_len);
+                index->text[index->text_size + key_len] = '\0';
+                index->text_size += key_len + 1;
+            }
+            prev = key;
+            prev_len = key_len;
+            index->rows++;
+        }
+        line = eol + 1;
+    }
+    return 1;
+}
+
+// Points keys at the entries' keys in text; 0 if text does not hold nentries keys.
+static inline int sparse_index_link(sparse_index_t *index) {
+    index->keys = malloc((index->nentries ? index->nentries : 1) * sizeof(char *));
+    if (!index->keys) {
         fprintf(stderr, "Out of memory!\n");
-        munmap(mapped, filesize);
         exit(EXIT_FAILURE);
     }
-    size_t count = 0;
+    size_t pos = 0;
+    for (size_t e = 0; e < index->nentries; e++) {
+        if (pos >= index->text_size) return 0;
+        index->keys[e] = index->text + pos;
+        pos += strnlen(index->text + pos, index->text_size - pos) + 1;
+    }
+    return pos == index->text_size;
+}
 
-    char *line_start = mapped;
-    char *line_end = mapped;
+// Writes the sparse index of a file sorted on its keys, through a temporary file like
+// mph_save; unsorted files get none.
+static inline void sparse_index_write(const char *path, const struct stat *sb) {
+    char sidecar[PATH_MAX], tmp[PATH_MAX + 16];
+    if (!sidecar_path(sidecar, sizeof(sidecar), path, ".idx")) return;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return;
+    char *mapped = sb->st_size ? mmap(NULL, sb->st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (mapped == MAP_FAILED) return;
+    sparse_index_t index = {0};
+    const int sorted = sparse_index_scan(mapped, sb->st_size, &index);
+    if (mapped) munmap(mapped, sb->st_size);
+    if (!sorted) {
+        sparse_index_free(&index);
+        return;
+    }
 
-    while (line_end < mapped + filesize) {
-        // Find the end of the line
-        while (line_end < mapped + filesize && *line_end != '\n') {
-            line_end++;
+    snprintf(tmp, sizeof(tmp), "%s.%d", sidecar, (int) getpid());
+    FILE *f = fopen(tmp, "wb");
+    if (!f) {
+        sidecar_write_failed(sidecar);
+    } else {
+        sparse_header_t header = {.stamp = file_stamp(sb), .interval = SPARSE_INTERVAL, .nentries = index.nentries,
+                                  .rows = index.rows, .text_size = index.text_size};
+        memcpy(header.magic, g_sparse_magic, sizeof(header.magic));
+        const int ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+                       fwrite(index.offsets, sizeof(uint64_t), index.nentries, f) == index.nentries &&
+                       fwrite(index.text, 1, index.text_size, f) == index.text_size;
+        if (fclose(f) != 0 || !ok || rename(tmp, sidecar) != 0) {
+            sidecar_write_failed(sidecar);
+            unlink(tmp);
         }
+    }
+    sparse_index_free(&index);
+}
 
-        // Determine line length and handle edge cases
-        size_t line_length = line_end - line_start;
-        if (line_length > 0) {
-            // Remove trailing carriage return if any
-            if (line_end > line_start && *(line_end - 1) == '\r') {
-                line_length--;
-            }
+// Reads the sparse index of the file if it was written for the file as it is now.
+static inline int sparse_index_load(const char *path, const struct stat *sb, sparse_index_t *index) {
+    char sidecar[PATH_MAX];
+    if (!sidecar_path(sidecar, sizeof(sidecar), path, ".idx")) return 0;
+    FILE *f = fopen(sidecar, "rb");
+    if (!f) return 0;
 
-            // Allocate memory for the line and copy its contents
-            records[count].line = malloc(line_length + 1); // +1 for null terminator
-            if (!records[count].line) {
-                fprintf(stderr, "Out of memory!\n");
-                munmap(mapped, filesize);
-                free(records); // Free allocated records before exiting
+    sparse_header_t header;
+    const file_stamp_t stamp = file_stamp(sb);
+    int ok = fread(&header, sizeof(header), 1, f) == 1 && memcmp(header.magic, g_sparse_magic, 8) == 0 &&
+             memcmp(&header.stamp, &stamp, sizeof(stamp)) == 0 && header.interval == SPARSE_INTERVAL &&
+             header.nentries <= header.rows && header.text_size <= header.stamp.size + header.nentries;
+    *index = (sparse_index_t) {.nentries = ok ? header.nentries : 0, .rows = header.rows,
+                               .text_size = header.text_size};
+    if (ok) {
+        index->offsets = malloc((index->nentries ? index->nentries : 1) * sizeof(uint64_t));
+        index->text = malloc(index->text_size ? index->text_size : 1);
+        ok = index->offsets && index->text &&
+             fread(index->offsets, sizeof(uint64_t), index->nentries, f) == index->nentries &&
+             fread(index->text, 1, index->text_size, f) == index->text_size && sparse_index_link(index);
+    }
+    for (size_t e = 1; ok && e < index->nentries; e++) ok = index->offsets[e - 1] < index->offsets[e];
+    ok = ok && (index->nentries == 0 || index->offsets[index->nentries - 1] < header.stamp.size);
+    fclose(f);
+    if (!ok) sparse_index_free(index);
+    return ok;
+}
+
+static int compare_key_ptrs(const void *a, const void *b) {
+    return strcmp(*(const char *const *) a, *(const char *const *) b);
+}
+
+// Marks the blocks that can hold rows with the key: from the block before the first entry
+// not less than key, since equal keys can end that block, to the last entry not greater.
+static inline void sparse_mark_blocks(const sparse_index_t *index, const char *key, uint8_t *blocks) {
+    size_t low = 0, high = index->nentries;
+    while (low < high) {
+        const size_t mid = low + (high - low) / 2;
+        if (strcmp(index->keys[mid], key) < 0) low = mid + 1;
+        else high = mid;
+    }
+    size_t last = low;
+    while (last < index->nentries && strcmp(index->keys[last], key) == 0) last++;
+    if (last == 0) return; // before the first row
+    for (size_t b = low ? low - 1 : 0; b < last; b++) blocks[b] = 1;
+}
+
+// Loads the rows of the file whose key is one of column col of keys. Reads only the blocks
+// that can hold them if the file has a current sparse index and they are few, the whole
+// file otherwise, writing the sparse index for the next run if there was none.
+static inline void read_csv_selective(const char *path, table_t *table, const unsigned compress_cols,
+                                      const table_t *keys, const int col) {
+    struct stat sb;
+    sparse_index_t index;
+    if (stat(path, &sb) != 0 || !sparse_index_load(path, &sb, &index)) {
+        read_csv_file(path, table, compress_cols);
+        if (stat(path, &sb) == 0) sparse_index_write(path, &sb);
+        return;
+    }
+    if (keys->count > index.rows / 2) {
+        sparse_index_free(&index);
+        read_csv_file(path, table, compress_cols);
+        return;
+    }
+
+    // The distinct keys in order, then the blocks they need
+    const char **wanted = malloc((keys->count ? keys->count : 1) * sizeof(char *));
+    uint8_t *blocks = calloc(index.nentries ? index.nentries : 1, 1);
+    if (!wanted || !blocks) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < keys->count; i++) wanted[i] = record_field(keys, table_row(keys, i), col);
+    if (keys->sorted_col != col) qsort(wanted, keys->count, sizeof(char *), compare_key_ptrs);
+    size_t nblocks = 0;
+    for (size_t i = 0; i < keys->count; i++) {
+        if (i == 0 || strcmp(wanted[i - 1], wanted[i]) != 0) sparse_mark_blocks(&index, wanted[i], blocks);
+    }
+    for (size_t b = 0; b < index.nentries; b++) nblocks += blocks[b];
+    free(wanted);
+    if (2 * nblocks > index.nentries) {
+        free(blocks);
+        sparse_index_free(&index);
+        read_csv_file(path, table, compress_cols);
+        return;
+    }
+
+    // Runs of needed blocks are read with one pread each into one buffer of whole lines
+    const size_t filesize = sb.st_size;
+    size_t size = 0;
+    for (size_t b = 0; b < index.nentries; b++) {
+        if (blocks[b]) size += (b + 1 < index.nentries ? index.offsets[b + 1] : filesize) - index.offsets[b];
+    }
+    char *data = malloc(size ? size : 1);
+    int fd = open(path, O_RDONLY);
+    if (!data || fd == -1) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    size_t pos = 0;
+    for (size_t b = 0; b < index.nentries;) {
+        if (!blocks[b]) {
+            b++;
+            continue;
+        }
+        size_t e = b;
+        while (e < index.nentries && blocks[e]) e++;
+        const size_t begin = index.offsets[b], end = e < index.nentries ? index.offsets[e] : filesize;
+        for (size_t done = 0; done < end - begin;) {
+            const ssize_t n = pread(fd, data + pos + done, end - begin - done, begin + done);
+            if (n <= 0) {
+                perror("pread");
                 exit(EXIT_FAILURE);
             }
-            memcpy(records[count].line, line_start, line_length);
-            records[count].line[line_length] = '\0'; // Null-terminate the string
+            done += n;
+        }
+        pos += end - begin;
+        b = e;
+    }
+    close(fd);
+    free(blocks);
+    sparse_index_free(&index);
 
-            // Split into fields
-            records[count].nfields = 0;
-            char *save = NULL;
-            char *token = strtok_r(records[count].line, ",", &save);
-            while (token && records[count].nfields < MAX_FIELDS) {
-                records[count].fields[records[count].nfields++] = token;
-                token = strtok_r(NULL, ",", &save);
-            }
+    if (compress_cols && size) train_columns(table, data, size, compress_cols, path);
+    parse_lines(data, data + size, table);
+    free(data);
+    atomic_fetch_add(&g_selective_loads, 1);
+    atomic_fetch_add(&g_selective_bytes, size);
+    atomic_fetch_add(&g_selective_file_bytes, filesize);
+}
 
-            count++;
-        }
+static inline void print_load_stats(void) {
+    const size_t loads = atomic_load(&g_selective_loads);
+    if (loads) {
+        fprintf(stderr, "selective loads: %zu, read %zu of %zu bytes\n", loads, atomic_load(&g_selective_bytes),
+                atomic_load(&g_selective_file_bytes));
+    }
+}
 
-        // Move to the next line
-        line_end++;
-        line_start = line_end;
+static void run_load(task_t *task) {
+    const unsigned compress_cols = g_compress != COMPRESS_OFF ? ~1u & ~task->text_cols : 0;
+    if (task->filter_col) {
+        read_csv_selective(task->path, &task->out, compress_cols, &task->inputs[0]->out, task->filter_col);
+    } else {
+        read_csv_file(task->path, &task->out, compress_cols);
     }
+    if (task->sort_col) sort_by_column(&task->out, task->sort_col, 1);
+    if (task->hash_col) hash_column_build(&task->out, task->hash_col);
+    if (task->index_col) hash_index_build(&task->out, task->index_col);
+    if (task->mph_col) mph_index_build(&task->out, task->mph_col, task->path);
+    if (task->model_col) learned_index_build(&task->out, task->model_col);
+}
 
-    munmap(mapped, filesize); // Unmap the file
-    *records_out = records;
-    *count_out = count;
+static void run_join(task_t *task) {
+    table_t *left = &task->inputs[0]->out;
+    table_t *right = &task->inputs[1]->out;
+    // Inputs nobody else reads are freed while the join streams through them
+    const int release = atomic_load(&task->inputs[0]->consumers) == 1 &&
+                        atomic_load(&task->inputs[1]->consumers) == 1;
+    task->out.text_cols = task->text_cols;
+    join_on_columns(left, task->left_col, right, task->right_col, &task->out, release);
+    if (task->sort_col) sort_by_column(&task->out, task->sort_col, 1);
+    if (task->hash_col) hash_column_build(&task->out, task->hash_col);
+    if (task->index_col) hash_index_build(&task->out, task->index_col);
+    if (task->mph_col) mph_index_build(&task->out, task->mph_col, NULL);
+    if (task->model_col) learned_index_build(&task->out, task->model_col);
+}
+
+// One of nparts join tasks over a slice of the left table, streaming its rows to the writer.
+static void run_join_output(task_t *task) {
+    table_t *left = &task->inputs[0]->out;
+    table_t *right = &task->inputs[1]->out;
+
+    size_t begin, end, right_begin;
+    if (!join_slice(left, task->left_col, right, task->right_col, task->part, task->nparts,
+                    &begin, &end, &right_begin)) {
+        return;
+    }
+
+    output_t out = {.writer = &g_writer, .buf = outbuf_acquire(&g_writer)};
+    join_output_for(left, task->left_col, right, task->right_col)(left, begin, end, task->left_col, right,
+                                                                  right_begin, task->right_col, 0, &out);
+    outbuf_submit(out.writer, out.buf);
+}
+
+static void run_print(task_t *task) {
+    print_records_as_csv_buffered(&task->inputs[0]->out);
+}
+
+// Interesting orders: every merge join needs its inputs sorted on its join columns, so each
+// input is asked for that order. Inputs that already have it (join outputs are in key order)
+// skip the sort at run time. A hash join takes its inputs in any order and asks its right
+// input for a hash index instead, or with --join=mph a loaded file for a perfect hash index.
+// Its left input is asked for the key hashes, which its producer computes once in parallel.
+// A learned join only needs its right input sorted, plus a learned index over it.
+static inline void plan_orders(task_t *tasks, const int ntasks) {
+    for (int t = 0; t < ntasks; t++) {
+        const task_t *task = &tasks[t];
+        if (task->ninputs != 2) continue; // not a join
+        if (task->hash) {
+            if (g_join_mode == JOIN_MPH && task->inputs[1]->path) {
+                task->inputs[1]->mph_col = task->right_col;
+                continue;
+            }
+            task->inputs[1]->index_col = task->right_col;
+            if (task->inputs[0]->hash_col && task->inputs[0]->hash_col != task->left_col) {
+                fprintf(stderr, "%s: needs two hash columns!\n", task->inputs[0]->name);
+                exit(EXIT_FAILURE);
+            }
+            task->inputs[0]->hash_col = task->left_col;
+            continue;
+        }
+        if (task->learned) task->inputs[1]->model_col = task->right_col;
+        const int cols[2] = {task->left_col, task->right_col};
+        for (int k = task->learned ? 1 : 0; k < 2; k++) {
+            if (task->inputs[k]->sort_col && task->inputs[k]->sort_col != cols[k]) {
+                fprintf(stderr, "%s: needs two orders!\n", task->inputs[k]->name);
+                exit(EXIT_FAILURE);
+            }
+            task->inputs[k]->sort_col = cols[k];
+        }
+    }
+}
+
+// Fields of the first line of a file, split like record_split; 0 if it cannot be read.
+static inline int file_fields(const char *path) {
+    char buf[4096];
+    const int fd = open(path, O_RDONLY);
+    if (fd == -1) return 0;
+    const ssize_t n = read(fd, buf, sizeof(buf));
+    close(fd);
+    if (n <= 0) return 0;
+    const char *end = memchr(buf, '\n', n);
+    if (!end) end = buf + n;
+    if (end > buf && end[-1] == '\r') end--;
+    int fields = 0;
+    const char *field;
+    while (fields < MAX_FIELDS && line_field(&field, buf, end, fields) >= 0) fields++;
+    return fields;
+}
+
+// Marks column col of the task's output as a join key and follows it back through the
+// joins that produce it to the file column it is copied from.
+static inline void mark_text_col(task_t *task, const int col) {
+    task->text_cols |= 1u << col;
+    if (task->ninputs != 2 || col == 1) return; // a load, or a join's key, which its inputs mark
+    task_t *left = task->inputs[0], *right = task->inputs[1];
+    if (!left->fields || !right->fields) return;
+    // The key is followed by the other fields of the left and then of the right input
+    const int i = col - 2, j = i - (left->fields - 1);
+    if (j < 0) mark_text_col(left, (i < task->left_col - 1 ? i : i + 1) + 1);
+    else if (j < right->fields - 1) mark_text_col(right, (j < task->right_col - 1 ? j : j + 1) + 1);
 }
 
-static inline void free_records(record_t *records, size_t count) {
-    if (!records) return;
-    for (size_t i = 0; i < count; i++) {
-        free(records[i].line);
+// Columns that are never encoded: with --compress, every join key must be text where the
+// join reads it, in a file or in the output of an earlier join. The planned row shapes come
+// from the files' first lines; rows of another shape that carry an encoded field into a text
+// column of a join's output are decoded by that join (see join_codecs).
+static inline void plan_text_cols(task_t *tasks, const int ntasks) {
+    for (int t = 0; t < ntasks; t++) { // inputs come before the joins reading them
+        task_t *task = &tasks[t];
+        if (task->path) {
+            task->fields = file_fields(task->path);
+        } else if (task->ninputs == 2 && task->inputs[0]->fields && task->inputs[1]->fields) {
+            const int fields = task->inputs[0]->fields + task->inputs[1]->fields - 1;
+            task->fields = fields < MAX_FIELDS ? fields : MAX_FIELDS;
+        }
+    }
+    for (int t = 0; t < ntasks; t++) {
+        task_t *task = &tasks[t];
+        if (task->ninputs != 2 || task->path) continue; // not a join
+        mark_text_col(task->inputs[0], task->left_col);
+        mark_text_col(task->inputs[1], task->right_col);
     }
-    free(records);
 }
 
-static int g_sort_col;
+// Loads, sorts and joins the four files and writes the result to fd.
+static inline void run_pipeline(char *const paths[4], const int nthreads, const int fd) {
+    g_nthreads = nthreads;
+
+    enum { LOAD1, LOAD2, LOAD3, LOAD4, JOIN12, JOIN123, JOIN_FINAL, PRINT, NFIXED };
+    const int hash = g_join_mode == JOIN_HASH || g_join_mode == JOIN_MPH, learned = g_join_mode == JOIN_LEARNED;
+    task_t tasks[MAX_TASKS] = {
+        [LOAD1] = {.name = "load f1", .run = run_load, .path = paths[0]},
+        [LOAD2] = {.name = "load f2", .run = run_load, .path = paths[1]},
+        [LOAD3] = {.name = "load f3", .run = run_load, .path = paths[2]},
+        [LOAD4] = {.name = "load f4", .run = run_load, .path = paths[3]},
+        [JOIN12] = {.name = "join12", .run = run_join, .left_col = 1, .right_col = 1, .hash = hash,
+                    .learned = learned},
+        [JOIN123] = {.name = "join123", .run = run_join, .left_col = 1, .right_col = 1, .hash = hash,
+                     .learned = learned},
+    };
+
+    task_depends(&tasks[JOIN12], &tasks[LOAD1]);
+    task_depends(&tasks[JOIN12], &tasks[LOAD2]);
+    task_depends(&tasks[JOIN123], &tasks[JOIN12]);
+    task_depends(&tasks[JOIN123], &tasks[LOAD3]);
+    if (g_load_mode == LOAD_SELECTIVE) {
+        // The last file is loaded once the keys of join123 are known
+        tasks[LOAD4].filter_col = 4;
+        task_depends(&tasks[LOAD4], &tasks[JOIN123]);
+    }
+
+    int ntasks;
+    if (nthreads == 1) {
+        // Single-threaded: materialize the final join and print it
+        tasks[JOIN_FINAL] = (task_t) {.name = "join1234", .run = run_join, .left_col = 4, .right_col = 1,
+                                      .hash = hash, .learned = learned};
+        tasks[PRINT] = (task_t) {.name = "print", .run = run_print};
+        task_depends(&tasks[JOIN_FINAL], &tasks[JOIN123]);
+        task_depends(&tasks[JOIN_FINAL], &tasks[LOAD4]);
+        task_depends(&tasks[PRINT], &tasks[JOIN_FINAL]);
+        ntasks = NFIXED;
+    } else {
+        // The final join is split into slices that stream straight to the writer thread
+        const int nparts = nthreads * 4 < MAX_TASKS - JOIN_FINAL ? nthreads * 4 : MAX_TASKS - JOIN_FINAL;
+        for (int p = 0; p < nparts; p++) {
+            tasks[JOIN_FINAL + p] = (task_t) {.name = "join1234", .run = run_join_output, .left_col = 4,
+                                             .right_col = 1, .part = p, .nparts = nparts, .hash = hash,
+                                             .learned = learned};
+            task_depends(&tasks[JOIN_FINAL + p], &tasks[JOIN123]);
+            task_depends(&tasks[JOIN_FINAL + p], &tasks[LOAD4]);
+        }
+        ntasks = JOIN_FINAL + nparts;
+    }
+
+    plan_orders(tasks, ntasks);
+    if (g_compress != COMPRESS_OFF) plan_text_cols(tasks, ntasks);
+    writer_start(&g_writer, fd, g_outbuf_count ? g_outbuf_count : 2 * nthreads);
+    scheduler_run(tasks, ntasks, nthreads);
+    writer_finish(&g_writer);
+}
 
-int local_compare(const record_t *a, const record_t *b) {
-    const char *fa = g_sort_col <= a->nfields ? a->fields[g_sort_col - 1] : "";
-    const char *fb = g_sort_col <= b->nfields ? b->fields[g_sort_col - 1] : "";
-    return strcmp(fa, fb);
+static inline double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
 }
 
-void quicksort(record_t *records, int low, int high, int (*compare)(const record_t *, const record_t *)) {
-    if (low < high) {
-        record_t pivot = records[high];
-        int i = low - 1;
-        for (int j = low; j < high; j++) {
-            if (compare(&records[j], &pivot) <= 0) {
-                i++;
-                record_t temp = records[i];
-                records[i] = records[j];
-                records[j] = temp;
+// Sequential read bandwidth of one thread for every (cpu node, memory node) pair.
+static inline void bench_numa(void) {
+    const size_t bytes = 256UL << 20;
+    const size_t words = bytes / sizeof(uint64_t);
+    cpu_set_t original;
+    sched_getaffinity(0, sizeof(original), &original);
+
+    printf("nodes: %d\n", g_numa.nnodes);
+    for (int m = 0; m < g_numa.nnodes; m++) {
+        uint64_t *mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            perror("mmap");
+            exit(EXIT_FAILURE);
+        }
+        unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long)) + 1] = {0};
+        const int id = g_numa.node_ids[m];
+        mask[id / (8 * sizeof(unsigned long))] |= 1UL << (id % (8 * sizeof(unsigned long)));
+        if (g_numa.nnodes > 1 && numa_mbind(mem, bytes, MPOL_BIND, mask) != 0) perror("mbind");
+        for (size_t w = 0; w < words; w++) mem[w] = w;
+
+        for (int c = 0; c < g_numa.nnodes; c++) {
+            numa_bind_thread_to_node(c);
+            double best = 1e9;
+            volatile uint64_t sink = 0;
+            for (int rep = 0; rep < 5; rep++) {
+                const double start = now_seconds();
+                uint64_t sum = 0;
+                for (size_t w = 0; w < words; w++) sum += mem[w];
+                sink += sum;
+                const double elapsed = now_seconds() - start;
+                if (elapsed < best) best = elapsed;
             }
+            (void) sink;
+            printf("cpu node %d <- memory node %d: %6.2f GB/s%s\n", g_numa.node_ids[c], id,
+                   bytes / best / 1e9, c == m ? " (local)" : " (remote)");
         }
-        record_t temp = records[i + 1];
-        records[i + 1] = records[high];
-        records[high] = temp;
+        munmap(mem, bytes);
+    }
+    sched_setaffinity(0, sizeof(original), &original);
+}
 
-        int pivot_index = i + 1;
+// Simulated large-index mode: the rows of both tables live in a window around row 2^32
+// of otherwise unpopulated tables, so sort and join run on indices that need 64 bits.
+static inline void scale_table_init(table_t *table, const size_t base, const size_t rows,
+                                    const unsigned keys, unsigned seed, size_t *key_counts) {
+    *table = (table_t) {0};
+    const size_t end = base + rows;
+    for (size_t s = 0; s < (end + SEGMENT_MASK) >> SEGMENT_SHIFT; s++) {
+        table_add_segment(table, s >= base >> SEGMENT_SHIFT ? segment_alloc() : NULL);
+    }
+    table->count = end;
+
+    for (size_t i = base; i < end; i++) {
+        seed = seed * 1103515245 + 12345;
+        const unsigned key = (seed >> 8) % keys;
+        key_counts[key]++;
 
-        quicksort(records, low, pivot_index - 1, compare);
-        quicksort(records, pivot_index + 1, high, compare);
+        record_t *record = table_row(table, i);
+        char *line = heap_alloc(table, 24, record);
+        snprintf(line, 24, "%08u,%zu", key, i);
+        record_split(record, line);
     }
 }
 
-static inline void sort_by_column(record_t *records, const size_t count, const int col) {
-    g_sort_col = col;
-    quicksort(records, 0, count - 1, local_compare);
+static void emit_count(void *ctx, const char *key, const table_t *left, const record_t *lrec, const int left_col,
+                       const int left_fields, const table_t *right, const record_t *rrec, const int right_col,
+                       const int right_fields) {
+    (void) key, (void) left, (void) lrec, (void) left_col, (void) left_fields;
+    (void) right, (void) rrec, (void) right_col, (void) right_fields;
+    (*(size_t *) ctx)++;
 }
 
-static inline record_t *join_on_columns(const record_t *left, const size_t left_count, const int left_col,
-                                 const record_t *right, const size_t right_count, const int right_col,
-                                 size_t *out_count) {
-    size_t cnt = 0;
-    record_t *result = malloc(MAX_CAPACITY * sizeof(record_t));
-    if (!result) {
-        fprintf(stderr, "Out of memory in join!\n");
+static inline void bench_scale(void) {
+    const size_t rows = 1 << 20;
+    const unsigned keys = rows / 2;
+    const size_t left_base = (1UL << 32) - rows / 2;
+    const size_t right_base = (1UL << 31) + (1UL << 32);
+
+    size_t *left_keys = calloc(keys, sizeof(size_t));
+    size_t *right_keys = calloc(keys, sizeof(size_t));
+    if (!left_keys || !right_keys) {
+        fprintf(stderr, "Out of memory!\n");
         exit(EXIT_FAILURE);
     }
 
-    size_t i = 0, j = 0;
-    while (i < left_count && j < right_count) {
-        const char *lkey = left_col <= left[i].nfields ? left[i].fields[left_col - 1] : "";
-        const char *rkey = right_col <= right[j].nfields ? right[j].fields[right_col - 1] : "";
+    table_t left, right;
+    scale_table_init(&left, left_base, rows, keys, 1, left_keys);
+    scale_table_init(&right, right_base, rows / 4, keys, 2, right_keys);
 
-        const int cmp = strcmp(lkey, rkey);
-        if (cmp == 0) {
-            size_t li = i;
-
-            while (li < left_count &&
-                   strcmp(lkey, left_col <= left[li].nfields ? left[li].fields[left_col - 1] : "") == 0) {
-                size_t rj = j;
-                while (rj < right_count &&
-                       strcmp(rkey, right_col <= right[rj].nfields ? right[rj].fields[right_col - 1] : "") == 0) {
-
-                    // Calculate the required buffer size for the joined line
-                    size_t line_size = strlen(lkey) + 1; // Include delimiter
-
-                    for (int lf = 0; lf < left[li].nfields; lf++) {
-                        if (lf + 1 == left_col) continue;
-                        line_size += strlen(left[li].fields[lf]) + 1;
-                    }
-
-                    for (int rf = 0; rf < right[rj].nfields; rf++) {
-                        if ((rf + 1) == right_col) continue;
-                        line_size += strlen(right[rj].fields[rf]) + 1;
-                    }
-
-                    // Allocate buffer for the joined line
-                    char *line = malloc(line_size);
-                    if (!line) {
-                        fprintf(stderr, "Out of memory in join!\n");
-                        exit(EXIT_FAILURE);
-                    }
-
-                    // Construct the joined line
-                    char *ptr = line;
-                    ptr += sprintf(ptr, "%s", lkey);
-
-                    for (int lf = 0; lf < left[li].nfields; lf++) {
-                        if (lf + 1 == left_col) continue;
-                        ptr += sprintf(ptr, ",%s", left[li].fields[lf]);
-                    }
-
-                    for (int rf = 0; rf < right[rj].nfields; rf++) {
-                        if ((rf + 1) == right_col) continue;
-                        ptr += sprintf(ptr, ",%s", right[rj].fields[rf]);
-                    }
-
-                    // Populate the result record
-                    result[cnt].line = line;
-                    result[cnt].nfields = 0;
-
-                    char *save = NULL;
-                    char *token = strtok_r(line, ",", &save);
-                    while (token && result[cnt].nfields < MAX_FIELDS) {
-                        result[cnt].fields[result[cnt].nfields++] = token;
-                        token = strtok_r(NULL, ",", &save);
-                    }
-                    cnt++;
-
-                    if (cnt >= MAX_CAPACITY) {
-                        fprintf(stderr, "Exceeded maximum capacity in join!\n");
-                        exit(EXIT_FAILURE);
-                    }
-
-                    rj++;
-                }
-                li++;
-            }
+    double start = now_seconds();
+    sort_rows(&left, left_base, left.count, 1);
+    sort_rows(&right, right_base, right.count, 1);
+    const double sort_time = now_seconds() - start;
 
-            while (i < left_count &&
-                   strcmp(lkey, left_col <= left[i].nfields ? left[i].fields[left_col - 1] : "") == 0) {
-                i++;
-            }
-            while (j < right_count &&
-                   strcmp(rkey, right_col <= right[j].nfields ? right[j].fields[right_col - 1] : "") == 0) {
-                j++;
+    int sorted = 1;
+    for (size_t i = left_base + 1; i < left.count; i++) {
+        if (strcmp(table_field(&left, table_row(&left, i - 1), 0), table_field(&left, table_row(&left, i), 0)) > 0) {
+            sorted = 0;
+        }
+    }
+    for (size_t i = right_base + 1; i < right.count; i++) {
+        if (strcmp(table_field(&right, table_row(&right, i - 1), 0), table_field(&right, table_row(&right, i), 0)) > 0) {
+            sorted = 0;
+        }
+    }
+
+    size_t expected = 0, matches = 0;
+    for (unsigned k = 0; k < keys; k++) expected += left_keys[k] * right_keys[k];
+    start = now_seconds();
+    merge_join(&left, left_base, left.count, 1, 0, &right, right_base, 1, 0, 0, emit_count, &matches);
+    const double join_time = now_seconds() - start;
+
+    printf("rows %zu..%zu and %zu..%zu\n", left_base, left.count - 1, right_base, right.count - 1);
+    printf("sort: %.3f s, %s\n", sort_time, sorted ? "sorted" : "NOT SORTED");
+    printf("join: %.3f s, %zu matches, expected %zu\n", join_time, matches, expected);
+
+    free_table(&left);
+    free_table(&right);
+    free(left_keys);
+    free(right_keys);
+    if (!sorted || matches != expected) exit(EXIT_FAILURE);
+}
+
+// Sorts the same random (key, row) pairs with every kernel up to the selected isa and with the
+// radix sort (on the selected kernel). Keys share
+// their high bytes like short numeric strings do, so there are many equal keys.
+static inline void bench_sort_kernels(const size_t rows) {
+    sort_item_t *input = table_alloc(rows * sizeof(sort_item_t));
+    sort_item_t *items = table_alloc(rows * sizeof(sort_item_t));
+    if (!input || !items) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+    unsigned seed = 1;
+    for (size_t i = 0; i < rows; i++) {
+        seed = seed * 1103515245 + 12345;
+        char key[16];
+        snprintf(key, sizeof(key), "%zu", (seed >> 4) % rows);
+        input[i].key = key_prefix(key);
+        input[i].row = i;
+    }
+
+    printf("%-8s %10s %12s\n", "kernel", "time [s]", "Mitems/s");
+    for (int isa = g_isa; isa >= ISA_SCALAR; isa--) {
+        const sort_kernel_t *kernel = &g_sort_kernels[isa];
+        if (!kernel->name) continue;
+        memcpy(items, input, rows * sizeof(sort_item_t));
+        const double start = now_seconds();
+        items_quicksort(kernel, items, rows);
+        const double elapsed = now_seconds() - start;
+        for (size_t i = 1; i < rows; i++) {
+            if (items[i - 1].key > items[i].key) {
+                fprintf(stderr, "%s: not sorted at %zu\n", kernel->name, i);
+                exit(EXIT_FAILURE);
             }
-        } else if (cmp < 0) {
-            i++;
-        } else {
-            j++;
         }
+        printf("%-8s %10.3f %12.1f%s\n", kernel->name, elapsed, rows / elapsed / 1e6,
+               kernel == g_sort_kernel ? " (selected)" : "");
     }
 
-    *out_count = cnt;
-    return result;
+    memcpy(items, input, rows * sizeof(sort_item_t));
+    const double start = now_seconds();
+    radix_sort_items(items, rows, 0);
+    const double elapsed = now_seconds() - start;
+    for (size_t i = 1; i < rows; i++) {
+        if (items[i - 1].key > items[i].key) {
+            fprintf(stderr, "radix: not sorted at %zu\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    printf("%-8s %10.3f %12.1f\n", "radix", elapsed, rows / elapsed / 1e6);
+    table_free(input, rows * sizeof(sort_item_t));
+    table_free(items, rows * sizeof(sort_item_t));
 }
 
-static inline void print_records_as_csv(const record_t *records, const size_t count) {
-    for (size_t i = 0; i < count; i++) {
-        for (int f = 0; f < records[i].nfields; f++) {
-            if (f > 0) printf(",");
-            printf("%s", records[i].fields[f]);
+// Hashes the keys of a generated table with every hash kernel up to the selected isa and
+// checks that all of them compute the same hashes. Keys are short numbers and long strings.
+static inline void bench_hash(const size_t rows) {
+    table_t table = {0};
+    unsigned seed = 1;
+    for (size_t i = 0; i < rows; i++) {
+        seed = seed * 1103515245 + 12345;
+        record_t *record = table_append(&table);
+        char *line = heap_alloc(&table, 40, record);
+        snprintf(line, 40, i % 4 ? "%u,x" : "longprefix_shared_%u,x", (unsigned) ((seed >> 4) % rows));
+        record_split(record, line);
+    }
+    uint32_t *reference = malloc(rows * sizeof(uint32_t));
+    uint32_t *hashes = malloc(rows * sizeof(uint32_t));
+    if (!reference || !hashes) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%-14s %10s %12s\n", "kernel", "time [s]", "Mkeys/s");
+    int first = 1;
+    for (int isa = g_isa; isa >= ISA_SCALAR; isa--) {
+        const hash_kernel_t *kernel = &g_hash_kernels[isa];
+        if (!kernel->name) continue;
+        const double start = now_seconds();
+        kernel->hash_rows(&table, 1, 0, rows, first ? reference : hashes);
+        const double elapsed = now_seconds() - start;
+        if (!first && memcmp(reference, hashes, rows * sizeof(uint32_t)) != 0) {
+            fprintf(stderr, "%s: hashes differ\n", kernel->name);
+            exit(EXIT_FAILURE);
         }
-        printf("\n");
+        first = 0;
+        printf("%-14s %10.3f %12.1f%s\n", kernel->name, elapsed, rows / elapsed / 1e6,
+               kernel == g_hash_kernel ? " (selected)" : "");
     }
+    free(reference);
+    free(hashes);
+    free_table(&table);
 }
 
-static inline void print_records_as_csv_buffered(const record_t *records, const size_t count) {
-    char buffer[MAX_LINE_LEN]; // Preallocate a buffer for assembling each line
+// Trains a codec on generated column values (words and numbers, like the payload columns),
+// encodes and decodes all of them and reports the ratio and both throughputs.
+static inline void bench_fsst(const size_t rows) {
+    static const char *words[] = {"alpha", "bravo", "charlie", "delta", "echo", "foxtrot",
+                                  "golf", "hotel", "india", "juliet", "kilo", "lima"};
+    const size_t nwords = sizeof(words) / sizeof(words[0]);
+    const size_t capacity = rows * 40;
+    char *text = malloc(capacity);
+    uint16_t *lens = malloc(rows * sizeof(uint16_t));
+    uint8_t *coded = malloc(2 * capacity);
+    char *decoded = malloc(8 * capacity + 8);
+    codec_t *codec = codec_new("bench", 1);
+    if (!text || !lens || !coded || !decoded || !codec) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(EXIT_FAILURE);
+    }
+    unsigned seed = 1;
+    size_t ntext = 0;
+    for (size_t i = 0; i < rows; i++) {
+        seed = seed * 1103515245 + 12345;
+        const int len = snprintf(text + ntext, 40, "%s_%s_%u", words[(seed >> 8) % nwords],
+                                 words[(seed >> 16) % nwords], (seed >> 4) % 1000);
+        lens[i] = (uint16_t) len;
+        ntext += len;
+    }
 
-    for (size_t i = 0; i < count; i++) {
-        char *ptr = buffer; // Pointer to the current position in the buffer
-        size_t remaining = MAX_LINE_LEN; // Track remaining buffer space
+    const size_t nsamples = rows < 4096 ? rows : 4096;
+    double start = now_seconds();
+    fsst_train(codec, text, lens, nsamples);
+    const double train_time = now_seconds() - start;
 
-        for (int f = 0; f < records[i].nfields; f++) {
-            if (f > 0) { // Add delimiter before every field except the first
-                *ptr++ = ',';
-                remaining--;
-            }
+    start = now_seconds();
+    size_t ncoded = 0;
+    for (size_t i = 0, p = 0; i < rows; p += lens[i++]) {
+        ncoded += fsst_encode(codec, text + p, lens[i], coded + ncoded);
+    }
+    const double encode_time = now_seconds() - start;
 
-            // Copy the field into the buffer
-            size_t len = strnlen(records[i].fields[f], remaining);
-            if (len < remaining) {
-                memcpy(ptr, records[i].fields[f], len);
-                ptr += len;
-                remaining -= len;
-            } else {
-                fprintf(stderr, "Record exceeds maximum line length!\n");
-                break;
+    start = now_seconds();
+    const size_t ndecoded = fsst_decode(codec, coded, ncoded, decoded);
+    const double decode_time = now_seconds() - start;
+    if (ndecoded != ntext || memcmp(decoded, text, ntext) != 0) {
+        fprintf(stderr, "fsst: round trip mismatch\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%zu values, %d symbols, trained in %.3f s\n", rows, codec->nsymbols, train_time);
+    printf("%zu -> %zu bytes (%.2fx)\n", ntext, ncoded, (double) ntext / ncoded);
+    printf("encode %.1f MB/s, decode %.1f MB/s\n", ntext / encode_time / 1e6, ntext / decode_time / 1e6);
+    free(text);
+    free(lens);
+    free(coded);
+    free(decoded);
+}
+
+// Schema-specialized kernels against the generic ones on the pipeline's final join: rows
+// of a 4-field table keyed on column 4 are joined with a 2-field table and the 5-field
+// result is formatted to /dev/null, on one thread.
+static inline void bench_format(const size_t rows) {
+    const int devnull = open("/dev/null", O_WRONLY);
+    if (devnull == -1) {
+        perror("/dev/null");
+        exit(EXIT_FAILURE);
+    }
+    table_t left = {0}, right = {0};
+    unsigned seed = 1;
+    for (size_t i = 0; i < rows; i++) {
+        seed = seed * 1103515245 + 12345;
+        record_t *record = table_append(&left);
+        char *line = heap_alloc(&left, 48, record);
+        snprintf(line, 48, "%u,v%u,%u,%010zu", seed >> 20, (seed >> 8) % 1000, seed % 97, i / 4);
+        record_split(record, line);
+    }
+    for (size_t i = 0; i < rows / 4; i++) {
+        seed = seed * 1103515245 + 12345;
+        record_t *record = table_append(&right);
+        char *line = heap_alloc(&right, 32, record);
+        snprintf(line, 32, "%010zu,w%u", i, seed >> 16);
+        record_split(record, line);
+    }
+
+    const join_kernel_t joins[2] = {join_records_any, join_records_for(&left, 4, &right, 1)};
+    const char *names[2] = {"generic", "schema"};
+    double join_best[2] = {1e9, 1e9}, print_best[2] = {1e9, 1e9};
+    for (int round = 0; round < 3; round++) { // best of 3, the kernels alternating
+        for (int k = 0; k < 2; k++) {
+            table_t joined = {0};
+            join_codecs(&joined, &left, 4, &right, 1);
+            double start = now_seconds();
+            joins[k](&left, 0, left.count, 4, &right, 0, 1, 0, &joined);
+            const double join_time = now_seconds() - start;
+            if (joined.count != rows) {
+                fprintf(stderr, "format: %s joined %zu rows, expected %zu\n", names[k], joined.count, rows);
+                exit(EXIT_FAILURE);
             }
+
+            const rows_print_t print = k ? print_rows_for(&joined) : print_rows_any;
+            writer_start(&g_writer, devnull, 2);
+            start = now_seconds();
+            print(&joined, 0, joined.count);
+            writer_finish(&g_writer);
+            const double print_time = now_seconds() - start;
+            if (join_time < join_best[k]) join_best[k] = join_time;
+            if (print_time < print_best[k]) print_best[k] = print_time;
+            free_table(&joined);
         }
+    }
+    printf("%-8s %12s %14s\n", "kernel", "join Mrows/s", "format Mrows/s");
+    for (int k = 0; k < 2; k++) {
+        printf("%-8s %12.1f %14.1f\n", names[k], rows / join_best[k] / 1e6, rows / print_best[k] / 1e6);
+    }
+    free_table(&left);
+    free_table(&right);
+    close(devnull);
+}
+
+// Thread scalability: every parallel stage and the whole pipeline on generated data at
+// 1, 2, 4, ... threads. The bandwidth column is an estimate of the bytes each stage has
+// to move (input, records and heap written, records read per sort pass), not a measurement.
+typedef struct {
+    char *paths[4];
+    table_t left;   // sorted f1, the input of join and output
+    table_t right;  // sorted f2
+    table_t table;  // table the measured stage works on
+    size_t bytes;   // estimated bytes moved by the last run
+} bench_threads_t;
+
+static bench_threads_t g_bench;
+
+static inline size_t table_heap_bytes(const table_t *table) {
+    return table->heap ? atomic_load(&table->heap->nchunks) * ARENA_CHUNK_SIZE : 0;
+}
+
+static inline size_t file_size(const char *path) {
+    struct stat sb;
+    return stat(path, &sb) == 0 ? (size_t) sb.st_size : 0;
+}
+
+static void bench_parse(task_t *task) {
+    (void) task;
+    read_csv_file(g_bench.paths[0], &g_bench.table, 0);
+    g_bench.bytes = file_size(g_bench.paths[0]) + table_heap_bytes(&g_bench.table) +
+                    g_bench.table.count * sizeof(record_t);
+}
+
+static void bench_sort(task_t *task) {
+    (void) task;
+    sort_by_column(&g_bench.table, 1, 0);
+    size_t passes = 1;
+    while (((size_t) 1 << passes) < g_bench.table.count) passes++;
+    g_bench.bytes = 2 * passes * g_bench.table.count * sizeof(record_t);
+}
+
+static void bench_join(task_t *task) {
+    (void) task;
+    join_on_columns(&g_bench.left, 1, &g_bench.right, 1, &g_bench.table, 0);
+    g_bench.bytes = (g_bench.left.count + g_bench.right.count + g_bench.table.count) * sizeof(record_t) +
+                    table_heap_bytes(&g_bench.table);
+}
 
-        *ptr = '\0'; // Null-terminate the buffer
-        puts(buffer); // Output the line using a single system call
+// Hashes the keys of the right table and builds its hash index.
+static void bench_index(task_t *task) {
+    (void) task;
+    hash_column_free(&g_bench.right.hashes);
+    hash_index_free(&g_bench.right.index);
+    hash_index_build(&g_bench.right, 1);
+    g_bench.bytes = g_bench.right.count * (sizeof(record_t) + sizeof(uint32_t)) +
+                    (g_bench.right.index.mask + 1) * sizeof(uint64_t);
+}
+
+static void bench_output(task_t *task) {
+    (void) task;
+    print_records_as_csv_buffered(&g_bench.left);
+    g_bench.bytes = 2 * table_heap_bytes(&g_bench.left) + g_bench.left.count * sizeof(record_t);
+}
+
+// Runs a single-task graph and returns its wall time.
+static inline double bench_stage(void (*run)(task_t *), const int nthreads) {
+    task_t task = {.name = "bench", .run = run};
+    g_nthreads = nthreads;
+    const double start = now_seconds();
+    scheduler_run(&task, 1, nthreads);
+    return now_seconds() - start;
+}
+
+static inline void bench_generate(const char *path, const size_t rows, unsigned seed) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < rows; i++) {
+        seed = seed * 1103515245 + 12345;
+        const unsigned key = (seed >> 4) % rows;
+        seed = seed * 1103515245 + 12345;
+        const unsigned value = (seed >> 4) % rows;
+        fprintf(f, "%u,%u\n", key, value);
     }
+    fclose(f);
 }
 
-int main(const int argc, char *argv[]) {
-    if (argc != 5) {
-        fprintf(stderr, "Usage: %s file1 file2 file3 file4\n", argv[0]);
-        return EXIT_FAILURE;
+static inline void bench_print_row(const char *stage, const int threads, const double time,
+                                   const double base, const size_t bytes) {
+    printf("%-8s %7d %10.3f %8.2f %9.0f%% %9.2f\n", stage, threads, time, base / time,
+           100.0 * base / time / threads, bytes / time / 1e9);
+    fflush(stdout);
+}
+
+static inline void bench_threads(const int max_threads, const size_t rows) {
+    char dir[] = "/tmp/ourJoin-bench-XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        exit(EXIT_FAILURE);
     }
+    char paths[4][sizeof(dir) + 8];
+    for (int f = 0; f < 4; f++) {
+        snprintf(paths[f], sizeof(paths[f]), "%s/f%d.csv", dir, f + 1);
+        bench_generate(paths[f], rows, f + 1);
+        g_bench.paths[f] = paths[f];
+    }
+    const int devnull = open("/dev/null", O_WRONLY);
+    if (devnull == -1) {
+        perror("/dev/null");
+        exit(EXIT_FAILURE);
+    }
+
+    int counts[MAX_THREADS];
+    int ncounts = 0;
+    for (int t = 1; t < max_threads; t *= 2) counts[ncounts++] = t;
+    counts[ncounts++] = max_threads;
 
-    record_t *f1_records = NULL;
-    size_t f1_count = 0;
-    read_csv_file(argv[1], &f1_records, &f1_count);
-    sort_by_column(f1_records, f1_count, 1);
+    printf("%zu rows per file, up to %d threads\n", rows, max_threads);
+    printf("stage    threads   time [s]  speedup efficiency  est. GB/s\n");
 
-    record_t *f2_records = NULL;
-    size_t f2_count = 0;
-    read_csv_file(argv[2], &f2_records, &f2_count);
-    sort_by_column(f2_records, f2_count, 1);
+    double base = 0;
+    for (int c = 0; c < ncounts; c++) {
+        const double time = bench_stage(bench_parse, counts[c]);
+        if (c == 0) base = time;
+        bench_print_row("parse", counts[c], time, base, g_bench.bytes);
+        free_table(&g_bench.table);
+    }
+
+    for (int c = 0; c < ncounts; c++) {
+        read_csv_file(g_bench.paths[0], &g_bench.table, 0);
+        const double time = bench_stage(bench_sort, counts[c]);
+        if (c == 0) base = time;
+        bench_print_row("sort", counts[c], time, base, g_bench.bytes);
+        free_table(&g_bench.table);
+    }
 
-    size_t joined12_count = 0;
-    record_t *joined12 = join_on_columns(f1_records, f1_count, 1,
-                                         f2_records, f2_count, 1,
-                                         &joined12_count);
+    read_csv_file(g_bench.paths[0], &g_bench.left, 0);
+    sort_by_column(&g_bench.left, 1, 0);
+    read_csv_file(g_bench.paths[1], &g_bench.right, 0);
+    sort_by_column(&g_bench.right, 1, 0);
+    for (int c = 0; c < ncounts; c++) {
+        const double time = bench_stage(bench_join, counts[c]);
+        if (c == 0) base = time;
+        bench_print_row("join", counts[c], time, base, g_bench.bytes);
+        free_table(&g_bench.table);
+    }
 
-    free_records(f1_records, f1_count);
-    free_records(f2_records, f2_count);
+    for (int c = 0; c < ncounts; c++) {
+        const double time = bench_stage(bench_index, counts[c]);
+        if (c == 0) base = time;
+        bench_print_row("index", counts[c], time, base, g_bench.bytes);
+    }
+    hash_column_build(&g_bench.left, 1); // the probe side's producer hashes it in the pipeline
+    for (int c = 0; c < ncounts; c++) { // probes the index built above
+        const double time = bench_stage(bench_join, counts[c]);
+        if (c == 0) base = time;
+        bench_print_row("hashjoin", counts[c], time, base, g_bench.bytes);
+        free_table(&g_bench.table);
+    }
+    hash_index_free(&g_bench.right.index);
 
-    record_t *f3_records = NULL;
-    size_t f3_count = 0;
-    read_csv_file(argv[3], &f3_records, &f3_count);
-    sort_by_column(f3_records, f3_count, 1);
+    for (int c = 0; c < ncounts; c++) {
+        writer_start(&g_writer, devnull, 2 * counts[c]);
+        const double time = bench_stage(bench_output, counts[c]);
+        writer_finish(&g_writer);
+        if (c == 0) base = time;
+        bench_print_row("output", counts[c], time, base, g_bench.bytes);
+    }
+    free_table(&g_bench.left);
+    free_table(&g_bench.right);
 
-    size_t joined123_count = 0;
-    record_t *joined123 = join_on_columns(joined12, joined12_count, 1,
-                                          f3_records, f3_count, 1,
-                                          &joined123_count);
+    size_t input = 0;
+    for (int f = 0; f < 4; f++) input += file_size(g_bench.paths[f]);
+    for (int c = 0; c < ncounts; c++) {
+        const double start = now_seconds();
+        run_pipeline(g_bench.paths, counts[c], devnull);
+        const double time = now_seconds() - start;
+        if (c == 0) base = time;
+        bench_print_row("pipeline", counts[c], time, base, input);
+    }
 
-    free_records(joined12, joined12_count);
-    free_records(f3_records, f3_count);
+    close(devnull);
+    for (int f = 0; f < 4; f++) unlink(paths[f]);
+    rmdir(dir);
+}
 
-    sort_by_column(joined123, joined123_count, 4);
+static _Noreturn inline void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-j threads] [--numa=off|local|interleave] [--cpus=list] [--pin] [--out-buffers=N] [--sort=radix|prefix|quick] [--compress=fsst|typed|off] [--keys=front|plain] [--join=adaptive|merge|hash|mph|learned] [--load=full|selective] [--sidecars=off|DIR] [--force-isa=avx512|avx2|sse4.2|scalar] [--stats] file1 file2 file3 file4\n"
+                    "       %s --bench=numa|scale|threads|sort|fsst|format|hash [-j max threads] [--rows=N] [--force-isa=...]\n", prog, prog);
+    exit(EXIT_FAILURE);
+}
 
-    record_t *f4_records = NULL;
-    size_t f4_count = 0;
-    read_csv_file(argv[4], &f4_records, &f4_count);
-    sort_by_column(f4_records, f4_count, 1);
+int main(const int argc, char *argv[]) {
+    long nthreads = 0; // default: every cpu we may run on
 
-    size_t final_count = 0;
-    record_t *final_join = join_on_columns(joined123, joined123_count, 4,
-                                           f4_records, f4_count, 1,
-                                           &final_count);
+    static const struct option long_options[] = {
+        {"threads", required_argument, NULL, 'j'},
+        {"numa", required_argument, NULL, 'n'},
+        {"bench", required_argument, NULL, 'b'},
+        {"cpus", required_argument, NULL, 'c'},
+        {"pin", no_argument, NULL, 'p'},
+        {"out-buffers", required_argument, NULL, 'o'},
+        {"stats", no_argument, NULL, 's'},
+        {"rows", required_argument, NULL, 'r'},
+        {"sort", required_argument, NULL, 'S'},
+        {"compress", required_argument, NULL, 'z'},
+        {"keys", required_argument, NULL, 'k'},
+        {"join", required_argument, NULL, 'J'},
+        {"force-isa", required_argument, NULL, 'I'},
+        {"load", required_argument, NULL, 'L'},
+        {"sidecars", required_argument, NULL, 'C'},
+        {NULL, 0, NULL, 0},
+    };
+    const char *bench = NULL;
+    size_t bench_rows = 4000000;
+    isa_t forced_isa = NISAS; // none
+    cpu_set_t cpus;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "j:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'j':
+                nthreads = strtol(optarg, NULL, 10);
+                break;
+            case 'n':
+                if (strcmp(optarg, "off") == 0) g_numa_mode = NUMA_OFF;
+                else if (strcmp(optarg, "local") == 0) g_numa_mode = NUMA_LOCAL;
+                else if (strcmp(optarg, "interleave") == 0) g_numa_mode = NUMA_INTERLEAVE;
+                else usage(argv[0]);
+                break;
+            case 'b':
+                bench = optarg;
+                break;
+            case 'c':
+                if (parse_cpu_list(optarg, &cpus) != 0 || CPU_COUNT(&cpus) == 0) usage(argv[0]);
+                if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+                    perror("--cpus");
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'p':
+                g_pin = 1;
+                break;
+            case 's':
+                g_print_stats = 1;
+                break;
+            case 'r':
+                bench_rows = strtoul(optarg, NULL, 10);
+                if (bench_rows == 0) usage(argv[0]);
+                break;
+            case 'S':
+                if (strcmp(optarg, "radix") == 0) g_sort_backend = SORT_RADIX;
+                else if (strcmp(optarg, "prefix") == 0) g_sort_backend = SORT_PREFIX;
+                else if (strcmp(optarg, "quick") == 0) g_sort_backend = SORT_QUICK;
+                else usage(argv[0]);
+                break;
+            case 'z':
+                if (strcmp(optarg, "fsst") == 0) g_compress = COMPRESS_FSST;
+                else if (strcmp(optarg, "typed") == 0) g_compress = COMPRESS_TYPED;
+                else if (strcmp(optarg, "off") == 0) g_compress = COMPRESS_OFF;
+                else usage(argv[0]);
+                break;
+            case 'J':
+                if (strcmp(optarg, "adaptive") == 0) g_join_mode = JOIN_ADAPTIVE;
+                else if (strcmp(optarg, "merge") == 0) g_join_mode = JOIN_MERGE;
+                else if (strcmp(optarg, "hash") == 0) g_join_mode = JOIN_HASH;
+                else if (strcmp(optarg, "mph") == 0) g_join_mode = JOIN_MPH;
+                else if (strcmp(optarg, "learned") == 0) g_join_mode = JOIN_LEARNED;
+                else usage(argv[0]);
+                break;
+            case 'k':
+                if (strcmp(optarg, "front") == 0) g_front_keys = 1;
+                else if (strcmp(optarg, "plain") == 0) g_front_keys = 0;
+                else usage(argv[0]);
+                break;
+            case 'o':
+                g_outbuf_count = (int) strtol(optarg, NULL, 10);
+                if (g_outbuf_count < 1) usage(argv[0]);
+                break;
+            case 'L':
+                if (strcmp(optarg, "full") == 0) g_load_mode = LOAD_FULL;
+                else if (strcmp(optarg, "selective") == 0) g_load_mode = LOAD_SELECTIVE;
+                else usage(argv[0]);
+                break;
+            case 'C':
+                if (!optarg[0]) usage(argv[0]);
+                g_sidecar_dir = strcmp(optarg, "off") == 0 ? "" : optarg;
+                break;
+            case 'I':
+                for (forced_isa = ISA_SCALAR; forced_isa < NISAS; forced_isa++) {
+                    if (strcmp(optarg, g_isa_names[forced_isa]) == 0) break;
+                }
+                if (forced_isa == NISAS) usage(argv[0]);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    numa_detect();
+    pin_init();
+    kernels_init(forced_isa);
+    // Pinned workers share the cpus but the last one, which is the writer's
+    if (nthreads == 0) nthreads = g_pin && g_npin_cpus > 1 ? g_npin_cpus - 1 : g_npin_cpus;
+    if (nthreads < 1) nthreads = 1;
+    if (nthreads > MAX_THREADS) nthreads = MAX_THREADS;
 
-    free_records(joined123, joined123_count);
-    free_records(f4_records, f4_count);
+    if (bench) {
+        if (strcmp(bench, "numa") == 0) bench_numa();
+        else if (strcmp(bench, "scale") == 0) bench_scale();
+        else if (strcmp(bench, "threads") == 0) bench_threads((int) nthreads, bench_rows);
+        else if (strcmp(bench, "sort") == 0) bench_sort_kernels(bench_rows);
+        else if (strcmp(bench, "fsst") == 0) bench_fsst(bench_rows);
+        else if (strcmp(bench, "format") == 0) bench_format(bench_rows);
+        else if (strcmp(bench, "hash") == 0) bench_hash(bench_rows);
+        else usage(argv[0]);
+        return 0;
+    }
 
-    print_records_as_csv_buffered(final_join, final_count);
-    free_records(final_join, final_count);
+    if (argc - optind != 4) usage(argv[0]);
+    run_pipeline(argv + optind, (int) nthreads, STDOUT_FILENO);
+    if (g_print_stats) {
+        print_alloc_stats((int) nthreads);
+        print_codec_stats();
+        print_key_stats();
+        print_join_stats();
+        print_mph_stats();
+        print_load_stats();
+        print_kernel_stats();
+    }
     return 0;
 }
@@ -0,0 +1,38 @@
+#!/bin/bash
+# Joins the files of every case directory with each option set below and compares the sorted
+# output with the case's expected.csv, the output of the baseline implementation.
+# usage: tests/run.sh [ourJoin binary]
+
+join=$(realpath "${1:-./ourJoin}")
+cd "$(dirname "$0")" || exit 1
+sidecars=$(mktemp -d)
+trap 'rm -rf "$sidecars"' EXIT
+
+options=(
+  "-j 1"
+  "-j 4"
+  "-j 4 --join=hash"
+  "--compress=fsst -j 1"
+  "--compress=fsst -j 4"
+  "--compress=typed -j 1"
+  "--compress=typed -j 4"
+  "--compress=fsst --join=hash"
+  "--compress=typed --join=learned"
+  "--join=mph --sidecars=$sidecars" # writes the perfect hashes
+  "--join=mph --sidecars=$sidecars" # reads them
+  "--load=selective --sidecars=$sidecars" # writes the sparse index of a sorted f4
+  "--load=selective --sidecars=$sidecars" # reads it
+)
+
+failed=0
+for case in */; do
+  case=${case%/}
+  for opts in "${options[@]}"; do
+    if ! (cd "$case" && $join $opts f1.csv f2.csv f3.csv f4.csv 2>/dev/null | sort | cmp -s - expected.csv); then
+      echo "FAIL $case $opts"
+      failed=1
+    fi
+  done
+done
+[ $failed -eq 0 ] && echo "all tests passed"
+exit $failed